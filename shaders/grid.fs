@@ -0,0 +1,16 @@
+#version 330 core
+
+// Each texel holds 32 pixels of a row, leftmost in the most significant bit.
+// A row is a little endian 64-bit word, so its left half is the second texel.
+uniform usampler2DArray screens;
+
+in vec2 pixel;
+flat in int layer;
+out vec4 color;
+
+void main() {
+    ivec2 p = min(ivec2(pixel), ivec2(63, 31));
+    uint word = texelFetch(screens, ivec3(1 - p.x / 32, p.y, layer), 0).r;
+    float lit = float(word >> uint(31 - p.x % 32) & 1u);
+    color = vec4(vec3(lit), 1.0);
+}
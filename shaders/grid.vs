@@ -0,0 +1,20 @@
+#version 330 core
+
+// One instance per tile, laid out row by row from the top left. The quad's
+// corners come from gl_VertexID, drawn as a triangle strip.
+uniform ivec2 grid; // columns, rows
+uniform float gap;  // fraction of a cell left around the tile
+
+out vec2 pixel;
+flat out int layer;
+
+void main() {
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    vec2 cell = 2.0 / vec2(grid);
+    vec2 origin = vec2(-1.0 + (gl_InstanceID % grid.x) * cell.x,
+                       1.0 - (gl_InstanceID / grid.x + 1) * cell.y);
+    vec2 inset = cell * gap * 0.5;
+    gl_Position = vec4(origin + inset + corner * (cell - 2.0 * inset), 0.0, 1.0);
+    pixel = vec2(corner.x * 64.0, (1.0 - corner.y) * 32.0);
+    layer = gl_InstanceID;
+}
@@ -0,0 +1,347 @@
+#include "Analysis.h"
+#include "Disasm.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// Where ROMs are loaded and execution starts.
+static const uint16_t entry_point = 0x200;
+// Bytes per line of db in listings.
+static const unsigned db_width = 8;
+
+Analysis::Analysis(const uint8_t *rom, uint16_t size) {
+  memset(memory, 0, sizeof(memory));
+  size = std::min<uint16_t>(size, sizeof(memory) - entry_point);
+  memcpy(memory + entry_point, rom, size);
+  end = entry_point + size;
+  memset(kinds, Unreached, sizeof(kinds));
+  memset(leader, 0, sizeof(leader));
+  memset(jumped, 0, sizeof(jumped));
+  memset(referenced, 0, sizeof(referenced));
+  std::fill(std::begin(block_index), std::end(block_index), -1);
+
+  follow();
+  build_blocks();
+  for (const Block &block : block_list)
+    mark_data(block);
+  build_functions();
+}
+
+Instruction Analysis::fetch(uint16_t address) const {
+  return Instruction(memory[address] << 8 | memory[address + 1]);
+}
+
+// Whether an instruction at the address lies in the ROM without
+// overlapping one found before at the other alignment.
+bool Analysis::decodable(uint16_t address) const {
+  return address >= entry_point && address + 2 <= end &&
+         kinds[address] != Operand && kinds[address + 1] != Code;
+}
+
+void Analysis::follow() {
+  std::vector<uint16_t> work{entry_point};
+  leader[entry_point] = true;
+  auto branch = [&](uint16_t target) {
+    leader[target & 0xFFF] = true;
+    work.push_back(target & 0xFFF);
+  };
+  auto jump = [&](uint16_t target) {
+    jumped[target & 0xFFF] = true;
+    branch(target);
+  };
+  while (!work.empty()) {
+    uint16_t address = work.back();
+    work.pop_back();
+    // Straight-line code is followed here, branches through the worklist.
+    while (decodable(address) && kinds[address] != Code) {
+      kinds[address] = Code;
+      kinds[address + 1] = Operand;
+      Instruction inst = fetch(address);
+      uint16_t next = address + 2;
+      switch (inst.flow()) {
+      case Instruction::Next:
+        address = next;
+        continue;
+      case Instruction::Jump:
+        jump(inst.address());
+        break;
+      case Instruction::Call:
+        jump(inst.address());
+        branch(next);
+        break;
+      case Instruction::Return:
+        break;
+      case Instruction::Skip:
+        branch(next);
+        branch(next + 2);
+        break;
+      case Instruction::JumpIndexed:
+        for (unsigned offset = 0; offset <= 0xFF; offset += 2) {
+          if (inst.address() + offset + 2 > end)
+            break;
+          jump(inst.address() + offset);
+        }
+        break;
+      }
+      // The instruction after a control transfer starts a block whenever it
+      // is reached at all.
+      leader[next & 0xFFF] = true;
+      break;
+    }
+  }
+}
+
+void Analysis::build_blocks() {
+  for (unsigned address = entry_point; address < end;) {
+    if (kinds[address] != Code) {
+      ++address;
+      continue;
+    }
+    Block block;
+    block.start = address;
+    block.callee = 0;
+    for (;;) {
+      block_index[address] = block_list.size();
+      block.exit = fetch(address).flow();
+      address += 2;
+      if (block.exit != Instruction::Next || address >= end ||
+          kinds[address] != Code || leader[address])
+        break;
+    }
+    block.end = address;
+
+    Instruction last = fetch(block.end - 2);
+    auto add = [&](uint16_t target) {
+      target &= 0xFFF;
+      if (kinds[target] == Code &&
+          std::find(block.successors.begin(), block.successors.end(),
+                    target) == block.successors.end())
+        block.successors.push_back(target);
+    };
+    switch (block.exit) {
+    case Instruction::Next:
+      add(block.end);
+      break;
+    case Instruction::Jump:
+      add(last.address());
+      break;
+    case Instruction::Call:
+      block.callee = last.address();
+      add(block.end);
+      break;
+    case Instruction::Return:
+      break;
+    case Instruction::Skip:
+      add(block.end);
+      add(block.end + 2);
+      break;
+    case Instruction::JumpIndexed:
+      for (unsigned offset = 0; offset <= 0xFF; offset += 2)
+        add(last.address() + offset);
+      break;
+    }
+    block_list.push_back(std::move(block));
+  }
+}
+
+void Analysis::mark_data(const Block &block) {
+  // I is only known between an Annn and whatever changes it next.
+  int i = -1;
+  auto mark = [&](unsigned from, unsigned count) {
+    for (unsigned a = from; a < from + count && a < sizeof(kinds); ++a) {
+      if (kinds[a] == Unreached)
+        kinds[a] = Data;
+    }
+  };
+  for (uint16_t address = block.start; address < block.end; address += 2) {
+    Instruction inst = fetch(address);
+    if (inst.hnibble() == 0xA) {
+      i = inst.address();
+      referenced[i] = true;
+      mark(i, 1);
+    } else if (inst.hnibble() == 0xD && i >= 0) {
+      mark(i, inst.nibble());
+    } else if (inst.hnibble() == 0xF && i >= 0) {
+      switch (inst.byte()) {
+      case 0x33:
+        mark(i, 3);
+        break;
+      case 0x55:
+      case 0x65:
+        mark(i, inst.x() + 1);
+        break;
+      case 0x1E:
+      case 0x29:
+        i = -1;
+        break;
+      }
+    }
+  }
+}
+
+void Analysis::build_functions() {
+  std::vector<uint16_t> entries{entry_point};
+  for (const Block &block : block_list) {
+    if (block.exit == Instruction::Call && kinds[block.callee] == Code)
+      entries.push_back(block.callee);
+  }
+  std::sort(entries.begin(), entries.end());
+  entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+  std::vector<bool> seen(block_list.size());
+  for (uint16_t entry : entries) {
+    if (block_index[entry] < 0)
+      continue;
+    Function function;
+    function.entry = entry;
+    std::fill(seen.begin(), seen.end(), false);
+    std::vector<int> work{block_index[entry]};
+    seen[work[0]] = true;
+    while (!work.empty()) {
+      const Block &block = block_list[work.back()];
+      work.pop_back();
+      function.blocks.push_back(block.start);
+      if (block.exit == Instruction::Call && kinds[block.callee] == Code)
+        function.callees.push_back(block.callee);
+      for (uint16_t successor : block.successors) {
+        int index = block_index[successor];
+        if (!seen[index]) {
+          seen[index] = true;
+          work.push_back(index);
+        }
+      }
+    }
+    std::sort(function.blocks.begin(), function.blocks.end());
+    std::sort(function.callees.begin(), function.callees.end());
+    function.callees.erase(
+        std::unique(function.callees.begin(), function.callees.end()),
+        function.callees.end());
+    function_list.push_back(std::move(function));
+  }
+}
+
+Analysis::Kind Analysis::kind(uint16_t address) const {
+  return kinds[address & 0xFFF];
+}
+
+uint16_t Analysis::rom_end() const { return end; }
+
+unsigned Analysis::instruction_count() const { return byte_count(Code); }
+
+unsigned Analysis::byte_count(Kind k) const {
+  return std::count(kinds + entry_point, kinds + end, k);
+}
+
+const std::vector<Analysis::Block> &Analysis::blocks() const {
+  return block_list;
+}
+
+const std::vector<Analysis::Function> &Analysis::functions() const {
+  return function_list;
+}
+
+const Analysis::Block *Analysis::block_at(uint16_t address) const {
+  int index = block_index[address & 0xFFF];
+  return index < 0 ? nullptr : &block_list[index];
+}
+
+std::vector<uint16_t> Analysis::functions_at(uint16_t address) const {
+  std::vector<uint16_t> entries;
+  const Block *block = block_at(address);
+  if (!block)
+    return entries;
+  for (const Function &function : function_list) {
+    if (std::binary_search(function.blocks.begin(), function.blocks.end(),
+                           block->start))
+      entries.push_back(function.entry);
+  }
+  return entries;
+}
+
+std::string Analysis::label(uint16_t address) const {
+  char buf[16];
+  address &= 0xFFF;
+  if (address == entry_point)
+    return "start";
+  auto function = std::lower_bound(
+      function_list.begin(), function_list.end(), address,
+      [](const Function &f, uint16_t a) { return f.entry < a; });
+  if (function != function_list.end() && function->entry == address)
+    snprintf(buf, sizeof(buf), "sub_%03X", address);
+  else if (kinds[address] == Code && jumped[address])
+    snprintf(buf, sizeof(buf), "loc_%03X", address);
+  else if (referenced[address] && kinds[address] == Data)
+    snprintf(buf, sizeof(buf), "dat_%03X", address);
+  else
+    return "";
+  return buf;
+}
+
+void Analysis::write_listing(std::ostream &out) const {
+  char line[64];
+  for (unsigned address = entry_point; address < end;) {
+    std::string name = label(address);
+    if (!name.empty())
+      out << name << ":" << std::endl;
+    if (kinds[address] == Code) {
+      snprintf(line, sizeof(line), "%03X: %s", address,
+               disassemble(fetch(address)).c_str());
+      out << line << std::endl;
+      address += 2;
+      continue;
+    }
+    // A run of bytes of one kind, cut at labels and code.
+    Kind run = kinds[address];
+    int len = snprintf(line, sizeof(line), "%03X: db ", address);
+    unsigned count = 0;
+    do {
+      len += snprintf(line + len, sizeof(line) - len, " %02X",
+                      memory[address]);
+      ++address;
+      ++count;
+    } while (address < end && count < db_width && kinds[address] == run &&
+             label(address).empty());
+    if (run == Unreached)
+      snprintf(line + len, sizeof(line) - len, "%*s; unreached",
+               int(3 * (db_width - count) + 2), "");
+    out << line << std::endl;
+  }
+}
+
+void Analysis::write_cfg(std::ostream &out) const {
+  char line[64];
+  out << "digraph cfg {" << std::endl
+      << "  node [shape=box fontname=monospace];" << std::endl;
+  for (const Block &block : block_list) {
+    out << "  b" << std::hex << block.start << std::dec << " [label=\"";
+    std::string name = label(block.start);
+    if (!name.empty())
+      out << name << ":\\l";
+    for (uint16_t address = block.start; address < block.end; address += 2) {
+      snprintf(line, sizeof(line), "%03X: %s\\l", address,
+               disassemble(fetch(address)).c_str());
+      out << line;
+    }
+    out << "\"";
+    if (block.exit == Instruction::Return)
+      out << " peripheries=2";
+    out << "];" << std::endl;
+    for (uint16_t successor : block.successors)
+      out << "  b" << std::hex << block.start << " -> b" << successor
+          << std::dec << ";" << std::endl;
+  }
+  out << "}" << std::endl;
+}
+
+void Analysis::write_call_graph(std::ostream &out) const {
+  out << "digraph calls {" << std::endl << "  node [shape=box];" << std::endl;
+  for (const Function &function : function_list) {
+    out << "  \"" << label(function.entry) << "\" [label=\""
+        << label(function.entry) << "\\n" << function.blocks.size()
+        << " blocks\"];" << std::endl;
+    for (uint16_t callee : function.callees)
+      out << "  \"" << label(function.entry) << "\" -> \"" << label(callee)
+          << "\";" << std::endl;
+  }
+  out << "}" << std::endl;
+}
@@ -0,0 +1,88 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Instruction.h"
+
+// Static analysis of a ROM: follows every path from 0x200 through jumps,
+// calls, skips and returns (and, like disasm.py, every even target of a
+// Bnnn jump table inside the ROM) without running it. The result is a map
+// of which bytes are code and which are data, the basic blocks with their
+// control flow edges, and the functions (0x200 and every call target) with
+// their call graph. Code may start at odd addresses; an instruction that
+// would overlap one decoded before is not followed.
+//
+// Bytes are data when an instruction addresses them through I: sprites
+// drawn and bytes stored or loaded after an Annn in the same basic block,
+// and at least the first byte of any other Annn target.
+class Analysis {
+public:
+  enum Kind : uint8_t {
+    Unreached,
+    Code,    // first byte of an instruction
+    Operand, // second byte of an instruction
+    Data,
+  };
+
+  struct Block {
+    uint16_t start;
+    uint16_t end; // one past the last instruction
+    Instruction::Flow exit; // flow of the last instruction
+    std::vector<uint16_t> successors; // block starts
+    uint16_t callee; // when exit is Call
+  };
+
+  struct Function {
+    uint16_t entry;
+    std::vector<uint16_t> blocks;  // starts, ascending
+    std::vector<uint16_t> callees; // entries, ascending
+  };
+
+  Analysis(const uint8_t *rom, uint16_t size);
+
+  Kind kind(uint16_t address) const;
+  // The instruction at the address in the ROM as analysed.
+  Instruction fetch(uint16_t address) const;
+  uint16_t rom_end() const;
+  unsigned instruction_count() const;
+  unsigned byte_count(Kind) const;
+
+  const std::vector<Block> &blocks() const;   // by start
+  const std::vector<Function> &functions() const; // by entry
+  // The block containing the instruction at the address, or nullptr.
+  const Block *block_at(uint16_t address) const;
+  // The entries of every function the instruction belongs to.
+  std::vector<uint16_t> functions_at(uint16_t address) const;
+  // "start", "sub_2A4" for functions, "loc_2B0" for other jump targets,
+  // "dat_3B7" for data addressed through I, "" for anything else.
+  std::string label(uint16_t address) const;
+
+  // disasm.py style listing with labels, data and unreached bytes as db.
+  void write_listing(std::ostream &) const;
+  // Graphviz graphs: basic blocks with their instructions, and functions.
+  void write_cfg(std::ostream &) const;
+  void write_call_graph(std::ostream &) const;
+
+private:
+  uint8_t memory[0x1000];
+  uint16_t end;
+  Kind kinds[0x1000];
+  bool leader[0x1000];     // starts a basic block
+  bool jumped[0x1000];     // target of a jump or call
+  bool referenced[0x1000]; // target of an Annn
+  int16_t block_index[0x1000]; // for each instruction, -1 elsewhere
+  std::vector<Block> block_list;
+  std::vector<Function> function_list;
+
+  bool decodable(uint16_t address) const;
+  void follow();
+  void build_blocks();
+  void mark_data(const Block &);
+  void build_functions();
+};
+
+#endif
@@ -1,316 +1,140 @@
 #include "Chip8.h"
-#include <array>
-#include <bitset>
-#include <cstring>
-#include <iostream>
-#include <netinet/in.h>
 
-Chip8::Chip8(uint8_t *rom, uint16_t romSize)
-    : pc(0x200), I(0), delay_timer(0), waiting_for_key(-1),
-      distribution(0, 255) {
-  static const uint8_t fontset[80] = {
-      0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-      0x20, 0x60, 0x20, 0x20, 0x70, // 1
-      0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-      0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-      0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-      0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-      0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-      0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-      0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-      0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-      0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-      0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-      0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-      0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-      0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-      0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-  };
-  memset(memory, 0, 0x1000);
-  memset(screen, 0, 64 * 32);
-
-  memcpy(memory, fontset, sizeof(fontset));
-  if (romSize >= 0x1000 - 0x200) {
-    return;
-  }
-  memcpy(memory + 0x200, rom, romSize);
-}
-
-const std::array<std::function<void(Chip8 &, Instruction)>, 16>
-    Chip8::opcode_map{
-        &Chip8::op_system,   &Chip8::op_goto,      &Chip8::op_call,
-        &Chip8::op_skip_ceq, &Chip8::op_skip_cneq, &Chip8::op_skip_eq,
-        &Chip8::op_set,      &Chip8::op_inc,       &Chip8::op_arithmetic,
-        &Chip8::op_skip_neq, &Chip8::op_set_i,     &Chip8::op_goto_plus_v0,
-        &Chip8::op_random,   &Chip8::op_draw,      &Chip8::op_key,
-        &Chip8::op_reg,
+template <class Memory>
+const std::array<std::function<void(BasicChip8<Memory> &, Instruction)>, 16>
+    BasicChip8<Memory>::opcode_map{
+        &BasicChip8::op_system,       &BasicChip8::op_goto,
+        &BasicChip8::op_call,         &BasicChip8::op_skip_ceq,
+        &BasicChip8::op_skip_cneq,    &BasicChip8::op_skip_eq,
+        &BasicChip8::op_set,          &BasicChip8::op_inc,
+        &BasicChip8::op_arithmetic,   &BasicChip8::op_skip_neq,
+        &BasicChip8::op_set_i,        &BasicChip8::op_goto_plus_v0,
+        &BasicChip8::op_random,       &BasicChip8::op_draw,
+        &BasicChip8::op_key,          &BasicChip8::op_reg,
     };
 
-Instruction Chip8::cycle() {
+template <class Memory> Instruction BasicChip8<Memory>::cycle_dispatch() {
   if (delay_timer)
     --delay_timer;
   if (waiting_for_key == -1) {
-    Instruction instr(memory[pc] << 8 | memory[pc + 1]);
-    pc += 2;
-    // (opcode_map[instr.hnibble()])(*this, instr);
-    switch (instr.hnibble()) {
-    case 0x0:
-      op_system(instr);
-      break;
-    case 0x1:
-      op_goto(instr);
-      break;
-    case 0x2:
-      op_call(instr);
-      break;
-    case 0x3:
-      op_skip_ceq(instr);
-      break;
-    case 0x4:
-      op_skip_cneq(instr);
-      break;
-    case 0x5:
-      op_skip_eq(instr);
-      break;
-    case 0x6:
-      op_set(instr);
-      break;
-    case 0x7:
-      op_inc(instr);
-      break;
-    case 0x8:
-      op_arithmetic(instr);
-      break;
-    case 0x9:
-      op_skip_neq(instr);
-      break;
-    case 0xA:
-      op_set_i(instr);
-      break;
-    case 0xB:
-      op_goto_plus_v0(instr);
-      break;
-    case 0xC:
-      op_random(instr);
-      break;
-    case 0xD:
-      op_draw(instr);
-      break;
-    case 0xE:
-      op_key(instr);
-      break;
-    case 0xF:
-      op_reg(instr);
-      break;
-    }
-    return instr;
+    Instruction inst = fetch();
+    opcode_map[inst.hnibble()](*this, inst);
+    return inst;
   }
   return Instruction(0);
 }
 
-void Chip8::op_system(Instruction inst) {
-  if (inst.inst() == 0x00EE) {
-    if (!stack.empty()) {
-      pc = stack.top();
-      stack.pop();
-    } else {
-      pc = 0x200;
-    }
-  } else if (inst.inst() == 0x00E0) {
-    memset(screen, 0, sizeof(screen));
-  }
-}
-
-void Chip8::op_goto(Instruction inst) { pc = inst.address(); }
-
-void Chip8::op_call(Instruction inst) {
-  stack.push(pc);
-  pc = inst.address();
-}
-
-void Chip8::op_skip_ceq(Instruction inst) {
-  if (v[inst.x()] == inst.byte())
-    pc += 2;
-}
-
-void Chip8::op_skip_cneq(Instruction inst) {
-  if (v[inst.x()] != inst.byte())
-    pc += 2;
-}
-
-void Chip8::op_skip_eq(Instruction inst) {
-  if (v[inst.x()] == v[inst.y()])
-    pc += 2;
-}
-
-void Chip8::op_set(Instruction inst) { v[inst.x()] = inst.byte(); }
-
-void Chip8::op_inc(Instruction inst) { v[inst.x()] += inst.byte(); }
-
-void Chip8::op_arithmetic(Instruction inst) {
-  uint8_t &vx = v[inst.x()];
-  uint8_t vy = v[inst.y()];
-  uint8_t store = vx;
-
-  switch (inst.nibble()) {
-  case 0: // assign
-    vx = vy;
-    break;
-  case 1: // or
-    vx |= vy;
-    break;
-  case 2: // and
-    vx &= vy;
-    break;
-  case 3: // xor
-    vx ^= vy;
-    break;
-  case 4: // add
-    vx += vy;
-    v[0xF] = store > vx;
-    break;
-  case 5: // sub
-    vx -= vy;
-    v[0xF] = store > vx;
-    break;
-  case 6: // shift right
-    v[0xF] = vx & 1;
-    vx >>= 1;
-    break;
-  case 0xE: // shift left
-    v[0xF] = vx >> 7;
-    vx <<= 1;
-    break;
-  case 7: // rev sub
-    vx = vy - vx;
-    v[0xF] = vy >= vx;
-    break;
-  }
-}
-
-void Chip8::op_skip_neq(Instruction inst) {
-  if (v[inst.x()] != v[inst.y()]) {
-    pc += 2;
-  }
-}
-
-void Chip8::op_set_i(Instruction inst) { I = inst.address(); }
-
-void Chip8::op_goto_plus_v0(Instruction inst) { pc = inst.address() + v[0]; }
-
-void Chip8::op_random(Instruction inst) {
-  v[inst.x()] = distribution(random_engine) & inst.byte();
-}
-
-void Chip8::op_draw(Instruction inst) {
-  is_screen_updated = true;
-  uint8_t x = v[inst.x()];
-  uint8_t y = v[inst.y()];
-  uint8_t height = inst.nibble();
-  v[0xF] = 0;
-  for (int i = 0; i < height; i++) {
-    uint8_t line = memory[I + i];
-    for (int j = 0; j < 8; ++j, line >>= 1) {
-      uint8_t pos_x = (x + 7 - j) % 64; // % 64
-      uint8_t pos_y = (y + i) % 32;     // % 32
-      bool prev = screen[pos_x][pos_y];
-      screen[pos_x][pos_y] ^= line & 1;
-      if (prev && (line & 1)) {
-        v[0xF] = 1;
-      }
-    }
-  }
-}
-
-void Chip8::op_key(Instruction inst) {
-  switch (inst.byte()) {
-  case 0x9E:
-    if (keys[v[inst.x()]])
-      pc += 2;
-    break;
-  case 0xA1:
-    if (!keys[v[inst.x()]])
-      pc += 2;
-    break;
-  }
-}
-
-void Chip8::op_reg(Instruction inst) {
-  uint8_t &vx = v[inst.x()];
-  uint8_t x = inst.x();
-
-  uint8_t hundreds, tenths, ones;
-  switch (inst.byte()) {
-  case 0x07: // get delay_timer
-    vx = delay_timer;
-    break;
-  case 0x0A: // wait for key press
-    waiting_for_key = x;
-    break;
-  case 0x15: // set delay_timer
-    delay_timer = vx;
-    break;
-  case 0x18: // sound timer
-    break;   // TODO
-  case 0x1E:
-    I += vx;
-    break;
-  case 0x29:
-    I = vx * 5;
-    break;
-  case 0x33:
-    hundreds = vx / 100;
-    tenths = vx % 100 / 10;
-    ones = vx % 10;
-    memory[I] = hundreds;
-    memory[I + 1] = tenths;
-    memory[I + 2] = ones;
-    break;
-  case 0x55:
-    for (int i = 0; i <= x; ++i) {
-      memory[I + i] = v[i];
-    }
-    break;
-  case 0x65:
-    for (int i = 0; i <= x; ++i) {
-      v[i] = memory[I + i];
-    }
-    break;
-  }
-}
-
-void Chip8::press_key(uint8_t key) {
-  if (waiting_for_key != -1) {
-    v[waiting_for_key] = key;
-    waiting_for_key = -1;
-  }
-  keys[key] = true;
-}
-
-void Chip8::release_key(uint8_t key) { keys[key] = false; }
-
-bool Chip8::get_pixel(uint8_t x, uint8_t y) { return screen[x][y]; }
-
-uint8_t &Chip8::V(uint8_t idx) { return v[idx]; }
-
-uint8_t &Chip8::mem(uint16_t address) {
-  if (address >= 0x1000)
-    return memory[0xFFF];
-  return memory[address];
-}
-
-uint16_t &Chip8::refI(Chip8::Internal ref) {
-  switch (ref) {
-  case Chip8I:
-    return I;
-  case Chip8PC:
-    return pc;
-  }
-  return I;
-}
-
-bool Chip8::screen_updated() { return is_screen_updated; }
-
-void Chip8::screen_update() { is_screen_updated = false; }
-
-decltype(Chip8::screen) &Chip8::get_display() { return screen; }
\ No newline at end of file
+template Instruction Chip8::cycle_dispatch();
+template Instruction SharedChip8::cycle_dispatch();
+
+// Build-time regression tests: small programs run by the compiler.
+namespace {
+template <std::size_t N>
+constexpr Chip8 run(const std::array<uint8_t, N> &rom, unsigned cycles) {
+  Chip8 machine(rom);
+  for (unsigned i = 0; i < cycles; ++i)
+    machine.cycle();
+  return machine;
+}
+
+// mov V0, 2A; add V0, 01
+static_assert(run(std::array<uint8_t, 4>{0x60, 0x2A, 0x70, 0x01}, 2).V(0) ==
+              0x2B);
+
+// mov V0, FF; mov V1, 02; add V0, V1 sets the carry
+constexpr Chip8 carry =
+    run(std::array<uint8_t, 6>{0x60, 0xFF, 0x61, 0x02, 0x80, 0x14}, 3);
+static_assert(carry.V(0) == 0x01 && carry.V(0xF) == 1);
+
+// cll 206; jmp 204; ret
+constexpr Chip8 call = run(
+    std::array<uint8_t, 8>{0x22, 0x06, 0x12, 0x04, 0x00, 0x00, 0x00, 0xEE}, 2);
+static_assert(call.refI(Chip8::Chip8PC) == 0x202);
+
+// mov I, 000; drw V0, V0, 5 twice: the glyph "0" is drawn, then erased with
+// a collision
+constexpr Chip8 drawn = run(std::array<uint8_t, 4>{0xA0, 0x00, 0xD0, 0x05}, 2);
+static_assert(drawn.get_pixel(0, 0) && drawn.get_pixel(3, 4) &&
+              !drawn.get_pixel(1, 1) && drawn.V(0xF) == 0);
+constexpr Chip8 erased =
+    run(std::array<uint8_t, 6>{0xA0, 0x00, 0xD0, 0x05, 0xD0, 0x05}, 3);
+static_assert(!erased.get_pixel(0, 0) && erased.V(0xF) == 1);
+
+// cll 204; jmp 202; add V0, 01; se V0, 00; cll 204; ret: 256 nested calls,
+// then the first return goes back into the recursion without an underflow
+constexpr Chip8 deep = run(
+    std::array<uint8_t, 12>{0x22, 0x04, 0x12, 0x02, 0x70, 0x01, 0x30, 0x00,
+                            0x22, 0x04, 0x00, 0xEE},
+    1 + 255 * 3 + 3);
+static_assert(deep.refI(Chip8::Chip8PC) == 0x20A && deep.get_sp() &&
+              deep.get_faults() == Chip8::FaultStackOverflow);
+
+// mov V0, 3E; mov I, 000; drw V0, V1, 1: sprites wrap around the right
+// edge, and x is taken modulo 64
+constexpr Chip8 right_edge =
+    run(std::array<uint8_t, 6>{0x60, 0x3E, 0xA0, 0x00, 0xD0, 0x11}, 3);
+static_assert(right_edge.get_pixel(62, 0) && right_edge.get_pixel(63, 0) &&
+              right_edge.get_pixel(0, 0) && right_edge.get_pixel(1, 0) &&
+              !right_edge.get_pixel(2, 0) && !right_edge.get_pixel(61, 0));
+static_assert(
+    run(std::array<uint8_t, 6>{0x60, 0x7E, 0xA0, 0x00, 0xD0, 0x11}, 3)
+        .get_display()[0] == right_edge.get_display()[0]);
+
+// mov V1, 1F; mov I, 000; drw V0, V1, 2: and around the bottom edge
+constexpr Chip8 bottom_edge =
+    run(std::array<uint8_t, 6>{0x61, 0x1F, 0xA0, 0x00, 0xD0, 0x12}, 3);
+static_assert(bottom_edge.get_pixel(0, 31) && bottom_edge.get_pixel(3, 31) &&
+              bottom_edge.get_pixel(0, 0) && !bottom_edge.get_pixel(1, 0) &&
+              bottom_edge.get_pixel(3, 0));
+
+// mov V0, 7B; mov I, 300; bcd V0
+constexpr Chip8 bcd =
+    run(std::array<uint8_t, 6>{0x60, 0x7B, 0xA3, 0x00, 0xF0, 0x33}, 3);
+static_assert(bcd.peek(0x300) == 1 && bcd.peek(0x301) == 2 &&
+              bcd.peek(0x302) == 3);
+
+// mov V0, 05; mov DL, V0; skd 0: boot stops before the key check
+constexpr unsigned boot_cycles = [] {
+  Chip8 machine(
+      std::array<uint8_t, 6>{0x60, 0x05, 0xF0, 0x15, 0xE0, 0x9E});
+  return machine.boot(100);
+}();
+static_assert(boot_cycles == 2);
+
+// mov I, FFE; dump V0..V3 wraps around to the fontset and is reported
+constexpr Chip8 wrapped =
+    run(std::array<uint8_t, 6>{0x63, 0xAB, 0xAF, 0xFE, 0xF3, 0x55}, 3);
+static_assert(wrapped.peek(0x001) == 0xAB &&
+              wrapped.get_faults() == Chip8::FaultMemory);
+
+// mov V0, 7B; mov I, 300; bcd V0 on paged memory: the written page is
+// copied out of the image, which the other machines still share, and
+// copies of the machine own their pages
+constexpr bool copy_on_write() {
+  Chip8 initial(std::array<uint8_t, 6>{0x60, 0x7B, 0xA3, 0x00, 0xF0, 0x33});
+  SharedChip8 machine(initial), sibling(initial);
+  for (int i = 0; i < 3; ++i)
+    machine.cycle();
+  SharedChip8 copy(machine);
+  copy.mem(0x301) = 9;
+  if (initial.peek(0x300) || sibling.peek(0x300) ||
+      machine.peek(0x301) != 2 || copy.peek(0x300) != 1 ||
+      copy.peek(0x301) != 9 || machine.get_memory().private_pages() != 1)
+    return false;
+
+  // Writing every page spills past the inline pages without moving the
+  // pages taken before.
+  copy.mem(0x001) = 0;
+  uint8_t &spilled = copy.mem(0x081);
+  for (unsigned page = 0; page < 0x1000; page += PagedMemory::page_size)
+    copy.mem(page) = page / PagedMemory::page_size;
+  spilled = 0xAA;
+  sibling = copy;
+  copy.mem(0xFC1) = 1;
+  return copy.get_memory().private_pages() == 0x1000 / PagedMemory::page_size &&
+         sibling.peek(0x081) == 0xAA && sibling.peek(0xFC0) == 63 &&
+         !sibling.peek(0xFC1) && !initial.peek(0xFC0) &&
+         machine.get_memory().private_pages() == 1;
+}
+static_assert(copy_on_write());
+} // namespace
@@ -1,63 +1,600 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
-#include <map>
-#include <random>
-#include <stack>
+#include <type_traits>
 
 #include "Instruction.h"
+#include "Memory.h"
 
-class Chip8 {
+// The interpreter, with the layout of its memory as a parameter, see
+// Memory.h. Chip8, the machine used everywhere, owns flat memory: the whole
+// machine is a trivially copyable block of plain data, so instances are
+// created, reset, snapshotted and copied with one memcpy. The interpreter
+// is constexpr: ROMs given as std::array can be run at compile time, see
+// boot() and the checks at the end of Chip8.cpp. SharedChip8 runs pools of
+// one ROM with paged memory shared between the machines.
+template <class Memory> class alignas(64) BasicChip8 {
 private:
-  uint8_t v[16];
-  std::stack<uint16_t> stack;
-  uint8_t memory[0x1000];
-  uint16_t pc;
-  bool screen[64][32];
-  uint16_t I;
-  uint16_t delay_timer;
-  bool keys[16];
-  int8_t waiting_for_key;
-  bool is_screen_updated;
-
-  std::default_random_engine random_engine;
-  std::uniform_int_distribution<uint8_t> distribution;
-
-  void op_system(Instruction);
-  void op_goto(Instruction);
-  void op_call(Instruction);
-  void op_skip_ceq(Instruction);
-  void op_skip_cneq(Instruction);
-  void op_skip_eq(Instruction);
-  void op_set(Instruction);
-  void op_inc(Instruction);
-  void op_arithmetic(Instruction);
-  void op_skip_neq(Instruction);
-  void op_set_i(Instruction);
-  void op_goto_plus_v0(Instruction);
-  void op_random(Instruction);
-  void op_draw(Instruction);
-  void op_key(Instruction);
-  void op_reg(Instruction);
-  static const std::array<std::function<void(Chip8 &, Instruction)>, 16>
+  // Hot registers first, sharing the first cache line with the stack.
+  uint16_t pc{0x200};
+  uint16_t I{};
+  uint8_t v[16]{};
+  uint8_t sp{}; // call depth, see op_call
+  int8_t waiting_for_key{-1};
+  uint16_t delay_timer{};
+  uint16_t keys{}; // one bit per key
+  bool is_screen_updated{};
+  uint8_t faults{}; // sticky Fault bits
+  // Any non-zero seed works for xorshift, a fixed one keeps runs
+  // reproducible.
+  uint32_t random_state{0x2545F491};
+  uint16_t stack[16]{};
+  // One word per row, the leftmost pixel in the most significant bit.
+  uint64_t screen[32]{};
+  Memory memory;
+
+  constexpr uint8_t random_byte();
+  // Memory accesses wrap around at 4 KiB; ones that had to wrap are
+  // recorded as faults.
+  constexpr uint16_t wrap(uint16_t address);
+  constexpr Instruction fetch();
+
+  constexpr void op_system(Instruction);
+  constexpr void op_goto(Instruction);
+  constexpr void op_call(Instruction);
+  constexpr void op_skip_ceq(Instruction);
+  constexpr void op_skip_cneq(Instruction);
+  constexpr void op_skip_eq(Instruction);
+  constexpr void op_set(Instruction);
+  constexpr void op_inc(Instruction);
+  constexpr void op_arithmetic(Instruction);
+  constexpr void op_skip_neq(Instruction);
+  constexpr void op_set_i(Instruction);
+  constexpr void op_goto_plus_v0(Instruction);
+  constexpr void op_random(Instruction);
+  constexpr void op_draw(Instruction);
+  constexpr void op_key(Instruction);
+  constexpr void op_reg(Instruction);
+  static const std::array<std::function<void(BasicChip8 &, Instruction)>, 16>
       opcode_map;
 
+  template <class> friend class BasicChip8;
+  friend class Lockstep;
+
 public:
-  Chip8(uint8_t *, uint16_t);
-  Instruction cycle();
-  bool get_pixel(uint8_t x, uint8_t y);
-  decltype(Chip8::screen)& get_display();
+  constexpr BasicChip8(const uint8_t *, uint16_t);
+  template <std::size_t N>
+  constexpr explicit BasicChip8(const std::array<uint8_t, N> &rom)
+      : BasicChip8(rom.data(), N) {
+    static_assert(N <= 0x1000 - 0x200, "ROM does not fit in memory");
+  }
+  // The state of a machine with another memory layout, the memory built
+  // from its memory. SharedChip8 pool_start(initial) shares the memory of
+  // initial as the image, so initial must outlive the pool.
+  template <class Other>
+  constexpr explicit BasicChip8(const BasicChip8<Other> &);
+
+  constexpr Instruction cycle();
+  // Same as cycle(), dispatching through opcode_map instead of the switch.
+  Instruction cycle_dispatch();
+  // Runs until the next instruction would read the keypad, or for at most
+  // max_cycles. Everything before that point is deterministic, so a ROM's
+  // boot sequence can be pre-executed at compile time and the result used
+  // as its starting snapshot:
+  //   constexpr Chip8 start = [] { Chip8 m(rom); m.boot(1000); return m; }();
+  // Returns the number of cycles run.
+  constexpr unsigned boot(unsigned max_cycles);
+  constexpr bool get_pixel(uint8_t x, uint8_t y) const;
+  constexpr decltype(BasicChip8::screen)& get_display();
+  constexpr const decltype(BasicChip8::screen)& get_display() const;
 
   enum Internal { Chip8I, Chip8PC };
 
-  void press_key(uint8_t);
-  void release_key(uint8_t);
-  uint8_t &V(uint8_t);
-  uint8_t &mem(uint16_t);
-  uint16_t &refI(Chip8::Internal);
-  bool screen_updated();
-  void screen_update();
+  // Behaviour a well-formed ROM never triggers. The machine carries on
+  // (addresses wrap, the stack is a ring) and records what happened.
+  enum Fault : uint8_t {
+    FaultMemory = 1,         // I + offset past 0xFFF
+    FaultPC = 2,             // instruction fetched past 0xFFF
+    FaultStackOverflow = 4,  // more than 16 nested calls
+    FaultStackUnderflow = 8, // return with an empty stack
+    FaultKey = 16,           // key check with Vx above 0xF
+  };
+  constexpr uint8_t get_sp() const;
+  constexpr uint16_t get_delay_timer() const;
+  constexpr uint16_t get_keys() const; // bitmask of pressed keys
+  constexpr uint8_t get_faults() const;
+  constexpr void clear_faults();
+  static constexpr const char *fault_name(Fault);
+
+  constexpr void press_key(uint8_t);
+  constexpr void release_key(uint8_t);
+  constexpr void set_keys(uint16_t);
+  // True while Fx0A waits; the next key press is then read immediately.
+  constexpr bool waiting_for_input() const;
+  constexpr uint8_t &V(uint8_t);
+  constexpr uint8_t V(uint8_t) const;
+  // For writing: with shared memory, the page gets a private copy first.
+  constexpr uint8_t &mem(uint16_t);
+  constexpr uint8_t peek(uint16_t) const;
+  constexpr const Memory &get_memory() const;
+  constexpr uint16_t &refI(Internal);
+  constexpr uint16_t refI(Internal) const;
+  constexpr bool screen_updated() const;
+  constexpr void screen_update();
+  constexpr void reset(const BasicChip8 &initial);
 };
+
+typedef BasicChip8<FlatMemory> Chip8;
+typedef BasicChip8<PagedMemory> SharedChip8;
+
+static_assert(std::is_trivially_copyable<Chip8>::value,
+              "Chip8 must stay copyable with memcpy");
+// Machines are compared with memcmp (lockstep, run-ahead), which needs
+// every byte to be part of the state: no padding.
+static_assert(std::has_unique_object_representations_v<Chip8>,
+              "Chip8 must stay comparable with memcmp");
+
+template <class Memory>
+constexpr BasicChip8<Memory>::BasicChip8(const uint8_t *rom, uint16_t romSize)
+    : memory(rom, romSize) {}
+
+template <class Memory>
+template <class Other>
+constexpr BasicChip8<Memory>::BasicChip8(const BasicChip8<Other> &from)
+    : pc(from.pc), I(from.I), sp(from.sp),
+      waiting_for_key(from.waiting_for_key), delay_timer(from.delay_timer),
+      keys(from.keys), is_screen_updated(from.is_screen_updated),
+      faults(from.faults), random_state(from.random_state),
+      memory(from.memory) {
+  std::copy_n(from.v, 16, v);
+  std::copy_n(from.stack, 16, stack);
+  std::copy_n(from.screen, 32, screen);
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::reset(const BasicChip8 &initial) {
+  *this = initial;
+}
+
+template <class Memory>
+constexpr uint16_t BasicChip8<Memory>::wrap(uint16_t address) {
+  if (address > 0xFFF)
+    faults |= FaultMemory;
+  return address & 0xFFF;
+}
+
+template <class Memory>
+constexpr Instruction BasicChip8<Memory>::fetch() {
+  if (pc > 0xFFE) {
+    faults |= FaultPC;
+    pc &= 0xFFF;
+  }
+  Instruction inst(memory.read(pc) << 8 | memory.read((pc + 1) & 0xFFF));
+  pc += 2;
+  return inst;
+}
+
+template <class Memory>
+constexpr uint8_t BasicChip8<Memory>::random_byte() {
+  // xorshift32
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state >> 24;
+}
+
+template <class Memory>
+constexpr Instruction BasicChip8<Memory>::cycle() {
+  if (delay_timer)
+    --delay_timer;
+  if (waiting_for_key == -1) {
+    Instruction inst = fetch();
+    switch (inst.hnibble()) {
+    case 0x0:
+      op_system(inst);
+      break;
+    case 0x1:
+      op_goto(inst);
+      break;
+    case 0x2:
+      op_call(inst);
+      break;
+    case 0x3:
+      op_skip_ceq(inst);
+      break;
+    case 0x4:
+      op_skip_cneq(inst);
+      break;
+    case 0x5:
+      op_skip_eq(inst);
+      break;
+    case 0x6:
+      op_set(inst);
+      break;
+    case 0x7:
+      op_inc(inst);
+      break;
+    case 0x8:
+      op_arithmetic(inst);
+      break;
+    case 0x9:
+      op_skip_neq(inst);
+      break;
+    case 0xA:
+      op_set_i(inst);
+      break;
+    case 0xB:
+      op_goto_plus_v0(inst);
+      break;
+    case 0xC:
+      op_random(inst);
+      break;
+    case 0xD:
+      op_draw(inst);
+      break;
+    case 0xE:
+      op_key(inst);
+      break;
+    case 0xF:
+      op_reg(inst);
+      break;
+    }
+    return inst;
+  }
+  return Instruction(0);
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_system(Instruction inst) {
+  if (inst.inst() == 0x00EE) {
+    if (sp) {
+      pc = stack[--sp & 15];
+    } else {
+      faults |= FaultStackUnderflow;
+      pc = 0x200;
+    }
+  } else if (inst.inst() == 0x00E0) {
+    for (auto &row : screen)
+      row = 0;
+  }
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_goto(Instruction inst) {
+  pc = inst.address();
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_call(Instruction inst) {
+  // The stack is a ring of 16 entries, deeper calls overwrite the oldest
+  // return addresses. sp counts the depth up to 255 and then stays within
+  // 240..255, keeping its place in the ring without wrapping to empty.
+  if (sp >= 16)
+    faults |= FaultStackOverflow;
+  stack[sp & 15] = pc;
+  sp = sp == 255 ? 240 : sp + 1;
+  pc = inst.address();
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_skip_ceq(Instruction inst) {
+  if (v[inst.x()] == inst.byte())
+    pc += 2;
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_skip_cneq(Instruction inst) {
+  if (v[inst.x()] != inst.byte())
+    pc += 2;
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_skip_eq(Instruction inst) {
+  if (v[inst.x()] == v[inst.y()])
+    pc += 2;
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_set(Instruction inst) {
+  v[inst.x()] = inst.byte();
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_inc(Instruction inst) {
+  v[inst.x()] += inst.byte();
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_arithmetic(Instruction inst) {
+  uint8_t &vx = v[inst.x()];
+  uint8_t vy = v[inst.y()];
+  uint8_t store = vx;
+
+  switch (inst.nibble()) {
+  case 0: // assign
+    vx = vy;
+    break;
+  case 1: // or
+    vx |= vy;
+    break;
+  case 2: // and
+    vx &= vy;
+    break;
+  case 3: // xor
+    vx ^= vy;
+    break;
+  case 4: // add
+    vx += vy;
+    v[0xF] = store > vx;
+    break;
+  case 5: // sub
+    vx -= vy;
+    v[0xF] = store > vx;
+    break;
+  case 6: // shift right
+    v[0xF] = vx & 1;
+    vx >>= 1;
+    break;
+  case 0xE: // shift left
+    v[0xF] = vx >> 7;
+    vx <<= 1;
+    break;
+  case 7: // rev sub
+    vx = vy - vx;
+    v[0xF] = vy >= vx;
+    break;
+  }
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_skip_neq(Instruction inst) {
+  if (v[inst.x()] != v[inst.y()]) {
+    pc += 2;
+  }
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_set_i(Instruction inst) {
+  I = inst.address();
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_goto_plus_v0(Instruction inst) {
+  pc = inst.address() + v[0];
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_random(Instruction inst) {
+  v[inst.x()] = random_byte() & inst.byte();
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_draw(Instruction inst) {
+  is_screen_updated = true;
+  uint8_t x = v[inst.x()] % 64;
+  uint8_t y = v[inst.y()];
+  uint8_t height = inst.nibble();
+  v[0xF] = 0;
+  for (int i = 0; i < height; i++) {
+    // Rotate the sprite line into place so it wraps around horizontally.
+    uint64_t line = uint64_t(memory.read(wrap(I + i))) << 56;
+    if (x)
+      line = line >> x | line << (64 - x);
+    uint64_t &row = screen[(y + i) % 32];
+    if (row & line)
+      v[0xF] = 1;
+    row ^= line;
+  }
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_key(Instruction inst) {
+  uint8_t key = v[inst.x()];
+  if (key > 0xF && (inst.byte() == 0x9E || inst.byte() == 0xA1))
+    faults |= FaultKey;
+  switch (inst.byte()) {
+  case 0x9E:
+    if (keys >> (key & 15) & 1)
+      pc += 2;
+    break;
+  case 0xA1:
+    if (!(keys >> (key & 15) & 1))
+      pc += 2;
+    break;
+  }
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::op_reg(Instruction inst) {
+  uint8_t &vx = v[inst.x()];
+  uint8_t x = inst.x();
+
+  uint8_t hundreds, tenths, ones;
+  switch (inst.byte()) {
+  case 0x07: // get delay_timer
+    vx = delay_timer;
+    break;
+  case 0x0A: // wait for key press
+    waiting_for_key = x;
+    break;
+  case 0x15: // set delay_timer
+    delay_timer = vx;
+    break;
+  case 0x18: // sound timer
+    break;   // TODO
+  case 0x1E:
+    I += vx;
+    break;
+  case 0x29:
+    I = vx * 5;
+    break;
+  case 0x33:
+    hundreds = vx / 100;
+    tenths = vx % 100 / 10;
+    ones = vx % 10;
+    memory.write(wrap(I)) = hundreds;
+    memory.write(wrap(I + 1)) = tenths;
+    memory.write(wrap(I + 2)) = ones;
+    break;
+  case 0x55:
+    for (int i = 0; i <= x; ++i) {
+      memory.write(wrap(I + i)) = v[i];
+    }
+    break;
+  case 0x65:
+    for (int i = 0; i <= x; ++i) {
+      v[i] = memory.read(wrap(I + i));
+    }
+    break;
+  }
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::press_key(uint8_t key) {
+  if (waiting_for_key != -1) {
+    v[waiting_for_key] = key;
+    waiting_for_key = -1;
+  }
+  keys |= 1 << (key & 15);
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::release_key(uint8_t key) {
+  keys &= ~(1 << (key & 15));
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::set_keys(uint16_t mask) {
+  uint16_t pressed = mask & ~keys;
+  if (pressed && waiting_for_key != -1) {
+    uint8_t key = 0;
+    while (!(pressed >> key & 1))
+      ++key;
+    press_key(key);
+  }
+  keys = mask;
+}
+
+template <class Memory>
+constexpr bool BasicChip8<Memory>::get_pixel(uint8_t x, uint8_t y) const {
+  return screen[y % 32] >> (63 - x % 64) & 1;
+}
+
+template <class Memory>
+constexpr uint8_t &BasicChip8<Memory>::V(uint8_t idx) { return v[idx]; }
+
+template <class Memory>
+constexpr uint8_t BasicChip8<Memory>::V(uint8_t idx) const { return v[idx]; }
+
+template <class Memory>
+constexpr uint8_t &BasicChip8<Memory>::mem(uint16_t address) {
+  return memory.write(address < 0x1000 ? address : 0xFFF);
+}
+
+template <class Memory>
+constexpr uint8_t BasicChip8<Memory>::peek(uint16_t address) const {
+  return memory.read(address < 0x1000 ? address : 0xFFF);
+}
+
+template <class Memory>
+constexpr uint16_t BasicChip8<Memory>::refI(Internal ref) const {
+  return ref == Chip8PC ? pc : I;
+}
+
+template <class Memory>
+constexpr uint16_t &BasicChip8<Memory>::refI(Internal ref) {
+  switch (ref) {
+  case Chip8I:
+    return I;
+  case Chip8PC:
+    return pc;
+  }
+  return I;
+}
+
+template <class Memory>
+constexpr bool BasicChip8<Memory>::waiting_for_input() const {
+  return waiting_for_key != -1;
+}
+
+template <class Memory>
+constexpr bool BasicChip8<Memory>::screen_updated() const {
+  return is_screen_updated;
+}
+
+template <class Memory>
+constexpr uint8_t BasicChip8<Memory>::get_sp() const { return sp; }
+
+template <class Memory>
+constexpr uint16_t BasicChip8<Memory>::get_delay_timer() const {
+  return delay_timer;
+}
+
+template <class Memory>
+constexpr uint16_t BasicChip8<Memory>::get_keys() const { return keys; }
+
+template <class Memory>
+constexpr uint8_t BasicChip8<Memory>::get_faults() const { return faults; }
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::clear_faults() { faults = 0; }
+
+template <class Memory>
+constexpr const char *BasicChip8<Memory>::fault_name(Fault fault) {
+  switch (fault) {
+  case FaultMemory:
+    return "memory";
+  case FaultPC:
+    return "pc";
+  case FaultStackOverflow:
+    return "stack-overflow";
+  case FaultStackUnderflow:
+    return "stack-underflow";
+  case FaultKey:
+    return "key";
+  }
+  return "unknown";
+}
+
+template <class Memory>
+constexpr void BasicChip8<Memory>::screen_update() {
+  is_screen_updated = false;
+}
+
+template <class Memory>
+constexpr decltype(BasicChip8<Memory>::screen) &
+BasicChip8<Memory>::get_display() {
+  return screen;
+}
+
+template <class Memory>
+constexpr const decltype(BasicChip8<Memory>::screen) &
+BasicChip8<Memory>::get_display() const {
+  return screen;
+}
+
+template <class Memory>
+constexpr const Memory &BasicChip8<Memory>::get_memory() const {
+  return memory;
+}
+
+template <class Memory>
+constexpr unsigned BasicChip8<Memory>::boot(unsigned max_cycles) {
+  unsigned n = 0;
+  for (; n < max_cycles && waiting_for_key == -1; ++n) {
+    Instruction next(memory.read(pc & 0xFFF) << 8 |
+                     memory.read((pc + 1) & 0xFFF));
+    if (next.hnibble() == 0xE ||
+        (next.hnibble() == 0xF && next.byte() == 0x0A))
+      break;
+    cycle();
+  }
+  return n;
+}
+
 #endif
@@ -1,14 +1,16 @@
 #include <ncurses.h>
+#include <chrono>
 #include <csignal>
 #include <cstdint>
 #include <cstring>
 #include <clocale>
 #include <iostream>
+#include <thread>
 #include "CursesInterface.h"
 
 static const wchar_t blocks[] {L' ', L'\u2584', L'\u2580', L'\u2588'};
 
-CursesInterface::CursesInterface(Chip8& emu, int argc, char* args[]): Interface(emu, argc, args) {
+CursesInterface::CursesInterface(Chip8& emu, int argc, char* args[], const DisplayOptions&): Interface(emu, argc, args) {
 	setlocale(LC_ALL, "");
 	std::cout << argc << ' ' << args << std::endl;
 	for (int i = 0; i < argc; ++i) {
@@ -31,7 +33,8 @@ CursesInterface::~CursesInterface() {
 }
 
 bool CursesInterface::update() {
-	emulator.cycle();
+	if (!step())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	return true;
 }
 
@@ -48,7 +51,7 @@ void CursesInterface::update_screen() {
 		uint16_t& pc = emulator.refI(Chip8::Chip8PC);
 		printw("Pointer: %03X\n", pc);
 		printw("Executing: %04X\n",
-				emulator.mem(pc-2)<<8 | emulator.mem(pc-1));
+				emulator.peek(pc-2)<<8 | emulator.peek(pc-1));
 		printw("Registers: ");
 		for (int i = 0; i < 16; ++i) {
 			printw("%02X ", emulator.V(i));
@@ -4,7 +4,7 @@
 #define INTERFACE CursesInterface
 class CursesInterface : public Interface {
 	public:
-		CursesInterface(Chip8&, int, char* args[]);
+		CursesInterface(Chip8&, int, char* args[], const DisplayOptions& = DisplayOptions());
 		bool update();
 		void update_screen();
 		~CursesInterface();
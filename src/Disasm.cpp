@@ -0,0 +1,107 @@
+#include "Disasm.h"
+#include <cstdio>
+
+std::string disassemble(Instruction inst) {
+  char buf[32];
+  unsigned x = inst.x(), y = inst.y(), address = inst.address(),
+           byte = inst.byte(), nibble = inst.nibble();
+
+  switch (inst.hnibble()) {
+  case 0x0:
+    if (inst.inst() == 0x00E0)
+      return "clr";
+    if (inst.inst() == 0x00EE)
+      return "ret";
+    snprintf(buf, sizeof(buf), "njp %03X ; db 0%03X", address, address);
+    break;
+  case 0x1:
+    snprintf(buf, sizeof(buf), "jmp %03X", address);
+    break;
+  case 0x2:
+    snprintf(buf, sizeof(buf), "cll %03X", address);
+    break;
+  case 0x3:
+    snprintf(buf, sizeof(buf), "seq V%X, %02X", x, byte);
+    break;
+  case 0x4:
+    snprintf(buf, sizeof(buf), "sne V%X, %02X", x, byte);
+    break;
+  case 0x5:
+    snprintf(buf, sizeof(buf), "seq V%X, V%X", x, y);
+    break;
+  case 0x6:
+    snprintf(buf, sizeof(buf), "mov V%X, %02X", x, byte);
+    break;
+  case 0x7:
+    snprintf(buf, sizeof(buf), "add V%X, %02X", x, byte);
+    break;
+  case 0x8: {
+    static const char *const ops[16] = {"mov", "or ", "and", "xor", "add",
+                                        "sub", "shr", "rsu", nullptr, nullptr,
+                                        nullptr, nullptr, nullptr, nullptr,
+                                        "shl", nullptr};
+    if (ops[nibble])
+      snprintf(buf, sizeof(buf), "%s V%X, V%X", ops[nibble], x, y);
+    else
+      snprintf(buf, sizeof(buf), "db  8%03X", address);
+    break;
+  }
+  case 0x9:
+    snprintf(buf, sizeof(buf), "sne V%X, V%X", x, y);
+    break;
+  case 0xA:
+    snprintf(buf, sizeof(buf), "mov I, %03X", address);
+    break;
+  case 0xB:
+    snprintf(buf, sizeof(buf), "jmp [%03X + V0]", address);
+    break;
+  case 0xC:
+    snprintf(buf, sizeof(buf), "mov V%X, [random & %02X]", x, byte);
+    break;
+  case 0xD:
+    snprintf(buf, sizeof(buf), "drw V%X, V%X, %X", x, y, nibble);
+    break;
+  case 0xE:
+    if (byte == 0x9E)
+      snprintf(buf, sizeof(buf), "skd %X", x);
+    else if (byte == 0xA1)
+      snprintf(buf, sizeof(buf), "sku %X", x);
+    else
+      snprintf(buf, sizeof(buf), "db  %04X", inst.inst());
+    break;
+  case 0xF:
+    switch (byte) {
+    case 0x07:
+      snprintf(buf, sizeof(buf), "mov V%X, DL", x);
+      break;
+    case 0x0A:
+      snprintf(buf, sizeof(buf), "wky V%X", x);
+      break;
+    case 0x15:
+      snprintf(buf, sizeof(buf), "mov DL, V%X", x);
+      break;
+    case 0x18:
+      snprintf(buf, sizeof(buf), "mov SN, V%X", x);
+      break;
+    case 0x1E:
+      snprintf(buf, sizeof(buf), "mov I,  V%X", x);
+      break;
+    case 0x29:
+      snprintf(buf, sizeof(buf), "fnt I,  V%X", x);
+      break;
+    case 0x33:
+      snprintf(buf, sizeof(buf), "bcd V%X", x);
+      break;
+    case 0x55:
+      snprintf(buf, sizeof(buf), "dump V0..V%X", x);
+      break;
+    case 0x65:
+      snprintf(buf, sizeof(buf), "load V0..V%X", x);
+      break;
+    default:
+      snprintf(buf, sizeof(buf), "db  F%03X", address);
+    }
+    break;
+  }
+  return buf;
+}
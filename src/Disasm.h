@@ -0,0 +1,12 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <cstdint>
+#include <string>
+
+#include "Instruction.h"
+
+// Mnemonic of a single instruction, in the syntax of disasm.py.
+std::string disassemble(Instruction);
+
+#endif
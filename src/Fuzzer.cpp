@@ -0,0 +1,461 @@
+#include "Fuzzer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
+// Coverage map layout: one counter per PC, one per opcode pattern, then the
+// hashed (PC, next PC) edges.
+static const uint32_t pc_map = 0;
+static const uint32_t opcode_map = 0x1000;
+static const uint32_t edge_map = 0x2000;
+static const uint32_t edge_count = 1 << 16;
+static const uint32_t map_size = edge_map + edge_count;
+// Largest ROM the machine accepts.
+static const size_t max_rom_size = 0xE00 - 1;
+// Key events an input may grow to.
+static const size_t max_key_events = 256;
+
+// Instructions worth planting whole, with the operand bits left random.
+static const struct {
+  uint16_t op, operands;
+} templates[] = {
+    {0x00EE, 0x0000}, {0x1000, 0x0FFF}, {0x2000, 0x0FFF}, {0xA000, 0x0FFF},
+    {0xB000, 0x0FFF}, {0xD000, 0x0FFF}, {0xE09E, 0x0F00}, {0xE0A1, 0x0F00},
+    {0xF00A, 0x0F00}, {0xF01E, 0x0F00}, {0xF033, 0x0F00}, {0xF055, 0x0F00},
+    {0xF065, 0x0F00}, {0x6000, 0x0FFF}, {0x7000, 0x0FFF}, {0x3000, 0x0FFF},
+};
+
+static uint32_t edge_index(uint16_t from, uint16_t to) {
+  return edge_map + (((from * 0x9E3779B1u) >> 16 ^ to) & (edge_count - 1));
+}
+
+// The instruction with its operands cleared: 00E0, 8xy4 -> 8004, Fx55 ->
+// F055, 6xkk -> 6000.
+static uint16_t opcode_pattern(Instruction inst) {
+  switch (inst.hnibble()) {
+  case 0x0:
+    return inst.inst() == 0x00E0 || inst.inst() == 0x00EE ? inst.inst() : 0;
+  case 0x5:
+  case 0x8:
+  case 0x9:
+    return inst.inst() & 0xF00F;
+  case 0xE:
+  case 0xF:
+    return inst.inst() & 0xF0FF;
+  default:
+    return inst.inst() & 0xF000;
+  }
+}
+
+static std::string opcode_name(uint16_t pattern) {
+  static const char *const operands[16] = {
+      "nnn", "nnn", "nnn", "xkk", "xkk", "xy", "xkk", "xkk",
+      "xy",  "xy",  "nnn", "nnn", "xkk", "xyn", "x",  "x"};
+  unsigned h = pattern >> 12;
+  char buf[8];
+  if (pattern && h == 0)
+    snprintf(buf, sizeof(buf), "%04X", pattern);
+  else if (h == 0x5 || h == 0x8 || h == 0x9)
+    snprintf(buf, sizeof(buf), "%X%s%X", h, operands[h], pattern & 0xF);
+  else if (h == 0xE || h == 0xF)
+    snprintf(buf, sizeof(buf), "%X%s%02X", h, operands[h], pattern & 0xFF);
+  else
+    snprintf(buf, sizeof(buf), "%X%s", h, operands[h]);
+  return buf;
+}
+
+// Hit count classes, so that running a loop more often counts as new
+// behaviour only when the count changes magnitude.
+static uint8_t hit_class(uint8_t hits) {
+  if (hits <= 2)
+    return hits;
+  if (hits == 3)
+    return 4;
+  if (hits < 8)
+    return 8;
+  if (hits < 16)
+    return 16;
+  if (hits < 32)
+    return 32;
+  if (hits < 128)
+    return 64;
+  return 128;
+}
+
+static uint64_t fnv1a(const Fuzzer::Input &input) {
+  uint64_t hash = 0xCBF29CE484222325;
+  auto mix = [&](uint8_t byte) { hash = (hash ^ byte) * 0x100000001B3; };
+  for (uint8_t byte : input.rom)
+    mix(byte);
+  for (auto &ev : input.keys) {
+    for (int i = 0; i < 8; ++i)
+      mix(ev.cycle >> (8 * i));
+    mix(ev.key | ev.pressed << 4);
+  }
+  return hash;
+}
+
+Fuzzer::Trace::Trace() : hits(map_size) {}
+
+Fuzzer::Fuzzer(const Options &opts, const uint8_t *rom, uint16_t rom_size)
+    : options(opts), virgin(new std::atomic<uint8_t>[map_size]()), execs(0),
+      edges(0) {
+  Input seed;
+  seed.rom.assign(rom, rom + std::min<size_t>(rom_size, max_rom_size));
+  corpus.push_back(seed);
+  seed.keys = Lockstep::random_events(options.cycles, options.seed);
+  corpus.push_back(seed);
+}
+
+uint64_t Fuzzer::executions() const { return execs; }
+
+size_t Fuzzer::findings() const { return found.size(); }
+
+void Fuzzer::run() {
+  load_corpus();
+  Chip8 machine(nullptr, 0);
+  Trace trace;
+  Finding raised[8];
+  for (const Input &input : corpus) {
+    execute(machine, input, &trace, raised);
+    merge(trace);
+  }
+
+  unsigned threads = options.threads;
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; ++i)
+    workers.emplace_back(&Fuzzer::worker, this, i);
+  worker(0);
+  for (auto &th : workers)
+    th.join();
+}
+
+void Fuzzer::worker(unsigned index) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  auto deadline = start + std::chrono::duration_cast<clock::duration>(
+                              std::chrono::duration<double>(options.seconds));
+  auto next_stats = start + std::chrono::seconds(1);
+
+  std::minstd_rand rng(options.seed * 7919 + index);
+  Chip8 machine(nullptr, 0);
+  Trace trace;
+  Finding raised[8];
+  Input input;
+  for (auto now = clock::now(); now < deadline; now = clock::now()) {
+    if (index == 0 && now >= next_stats) {
+      print_stats(std::chrono::duration<double>(now - start).count());
+      next_stats += std::chrono::seconds(1);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(corpus_mtx);
+      input = corpus[rng() % corpus.size()];
+      if (rng() % 8 == 0) {
+        // Splice: the head of this input with the tail of another.
+        const Input &other = corpus[rng() % corpus.size()];
+        size_t cut = rng() % (std::min(input.rom.size(), other.rom.size()) + 1);
+        input.rom.resize(cut);
+        input.rom.insert(input.rom.end(), other.rom.begin() + cut,
+                         other.rom.end());
+      }
+    }
+    mutate(input, rng);
+
+    uint8_t faults = execute(machine, input, &trace, raised);
+    ++execs;
+    if (merge(trace)) {
+      std::lock_guard<std::mutex> lock(corpus_mtx);
+      corpus.push_back(input);
+      if (!options.corpus_dir.empty()) {
+        char name[20];
+        snprintf(name, sizeof(name), "%016llx",
+                 (unsigned long long)fnv1a(input));
+        save(options.corpus_dir, name, input);
+      }
+    }
+
+    for (int bit = 0; bit < 8; ++bit) {
+      if (!(faults >> bit & 1))
+        continue;
+      {
+        std::lock_guard<std::mutex> lock(findings_mtx);
+        if (!found.insert(raised[bit]).second)
+          continue;
+      }
+      Input minimized = input;
+      minimize(machine, minimized, raised[bit]);
+      report(minimized, raised[bit]);
+    }
+  }
+  if (index == 0)
+    print_stats(std::chrono::duration<double>(clock::now() - start).count());
+}
+
+void Fuzzer::mutate(Input &input, std::minstd_rand &rng) {
+  std::vector<uint8_t> &rom = input.rom;
+  auto &keys = input.keys;
+  unsigned count = 1 + rng() % 4;
+  for (unsigned n = 0; n < count; ++n) {
+    size_t even = rom.size() & ~size_t(1);
+    switch (rng() % 10) {
+    case 0: // flip a bit
+      if (!rom.empty())
+        rom[rng() % rom.size()] ^= 1 << rng() % 8;
+      break;
+    case 1: // random byte
+      if (!rom.empty())
+        rom[rng() % rom.size()] = rng();
+      break;
+    case 2:
+    case 3: { // plant an instruction on an instruction boundary
+      if (even == 0)
+        break;
+      auto &t = templates[rng() % std::size(templates)];
+      uint16_t inst = t.op | (rng() & t.operands);
+      size_t at = rng() % (even / 2) * 2;
+      rom[at] = inst >> 8;
+      rom[at + 1] = inst;
+      break;
+    }
+    case 4: { // insert an instruction
+      if (rom.size() + 2 > max_rom_size)
+        break;
+      size_t at = rng() % (even / 2 + 1) * 2;
+      uint16_t inst = rng();
+      rom.insert(rom.begin() + at, {uint8_t(inst >> 8), uint8_t(inst)});
+      break;
+    }
+    case 5: // delete an instruction
+      if (even >= 2) {
+        size_t at = rng() % (even / 2) * 2;
+        rom.erase(rom.begin() + at, rom.begin() + at + 2);
+      }
+      break;
+    case 6: { // press a key for a while
+      if (keys.size() + 2 > max_key_events)
+        break;
+      uint64_t at = rng() % options.cycles;
+      uint8_t key = rng() % 16;
+      keys.push_back(Lockstep::KeyEvent{at, key, true});
+      keys.push_back(Lockstep::KeyEvent{at + 1 + rng() % 200, key, false});
+      break;
+    }
+    case 7: // drop an event
+      if (!keys.empty())
+        keys.erase(keys.begin() + rng() % keys.size());
+      break;
+    case 8: // move an event
+      if (!keys.empty()) {
+        auto &ev = keys[rng() % keys.size()];
+        int shift = int(rng() % 201) - 100;
+        ev.cycle = std::max<int64_t>(0, int64_t(ev.cycle) + shift);
+      }
+      break;
+    case 9: // change which key an event is for
+      if (!keys.empty())
+        keys[rng() % keys.size()].key = rng() % 16;
+      break;
+    }
+  }
+  std::stable_sort(keys.begin(), keys.end(),
+                   [](const Lockstep::KeyEvent &a,
+                      const Lockstep::KeyEvent &b) { return a.cycle < b.cycle; });
+}
+
+uint8_t Fuzzer::execute(Chip8 &emu, const Input &input, Trace *trace,
+                        Finding findings[8]) const {
+  emu = Chip8(input.rom.data(), input.rom.size());
+  size_t next_event = 0;
+  uint8_t faults = 0;
+  Finding last{0, 0, 0};
+  for (unsigned cycle = 0; cycle < options.cycles; ++cycle) {
+    for (; next_event < input.keys.size() &&
+           input.keys[next_event].cycle <= cycle;
+         ++next_event) {
+      const Lockstep::KeyEvent &ev = input.keys[next_event];
+      if (ev.pressed)
+        emu.press_key(ev.key);
+      else
+        emu.release_key(ev.key);
+    }
+
+    uint16_t pc = emu.refI(Chip8::Chip8PC);
+    Instruction inst = emu.cycle();
+    uint16_t next_pc = emu.refI(Chip8::Chip8PC);
+    Finding current{0, opcode_pattern(inst), uint16_t(pc & 0xFFF)};
+    if (trace) {
+      uint32_t counters[3] = {pc_map + (pc & 0xFFF),
+                              opcode_map + (current.opcode >> 4 & 0xF00) +
+                                  (current.opcode & 0xFF),
+                              edge_index(pc, next_pc)};
+      for (uint32_t counter : counters) {
+        uint8_t &hits = trace->hits[counter];
+        if (hits == 0)
+          trace->touched.push_back(counter);
+        if (hits != 255)
+          ++hits;
+      }
+    }
+    if (uint8_t raised = emu.get_faults() & ~faults) {
+      for (int bit = 0; bit < 8; ++bit) {
+        if (!(raised >> bit & 1))
+          continue;
+        // Running off the end of memory is the fault of the instruction
+        // that got there, not of the fetch.
+        findings[bit] = (1 << bit) == Chip8::FaultPC ? last : current;
+        findings[bit].fault = 1 << bit;
+      }
+      faults |= raised;
+    }
+    last = current;
+    // Jumping to itself or waiting for a key, with no input left to change
+    // that.
+    if (next_pc == pc && next_event == input.keys.size())
+      break;
+  }
+  return faults;
+}
+
+bool Fuzzer::merge(Trace &trace) {
+  bool interesting = false;
+  for (uint32_t edge : trace.touched) {
+    uint8_t cls = hit_class(trace.hits[edge]);
+    trace.hits[edge] = 0;
+    uint8_t seen = virgin[edge].fetch_or(cls, std::memory_order_relaxed);
+    if (seen & cls)
+      continue;
+    interesting = true;
+    if (!seen)
+      ++edges;
+  }
+  trace.touched.clear();
+  return interesting;
+}
+
+bool Fuzzer::reproduces(Chip8 &emu, const Input &input,
+                        const Finding &finding) const {
+  Finding raised[8];
+  uint8_t faults = execute(emu, input, nullptr, raised);
+  if (!(faults & finding.fault))
+    return false;
+  int bit = 0;
+  while (!(finding.fault >> bit & 1))
+    ++bit;
+  return raised[bit].opcode == finding.opcode;
+}
+
+// Greedily drops key events, trailing ROM bytes and instructions (by zeroing
+// them) for as long as the same kind of instruction still raises the fault.
+void Fuzzer::minimize(Chip8 &emu, Input &input, const Finding &finding) const {
+  for (size_t i = input.keys.size(); i-- > 0;) {
+    Lockstep::KeyEvent ev = input.keys[i];
+    input.keys.erase(input.keys.begin() + i);
+    if (!reproduces(emu, input, finding))
+      input.keys.insert(input.keys.begin() + i, ev);
+  }
+
+  for (size_t step = input.rom.size() / 2; step > 0; step /= 2) {
+    while (input.rom.size() >= step) {
+      std::vector<uint8_t> tail(input.rom.end() - step, input.rom.end());
+      input.rom.resize(input.rom.size() - step);
+      if (!reproduces(emu, input, finding)) {
+        input.rom.insert(input.rom.end(), tail.begin(), tail.end());
+        break;
+      }
+    }
+  }
+
+  for (size_t at = 0; at + 1 < input.rom.size(); at += 2) {
+    uint8_t hi = input.rom[at], lo = input.rom[at + 1];
+    if (!hi && !lo)
+      continue;
+    input.rom[at] = input.rom[at + 1] = 0;
+    if (!reproduces(emu, input, finding)) {
+      input.rom[at] = hi;
+      input.rom[at + 1] = lo;
+    }
+  }
+}
+
+void Fuzzer::report(const Input &input, const Finding &finding) {
+  std::string name = Chip8::fault_name(Chip8::Fault(finding.fault));
+  name += "-" + opcode_name(finding.opcode);
+  save(options.crashes_dir, name, input);
+  std::string path = options.crashes_dir + "/" + name;
+  char pc[8];
+  snprintf(pc, sizeof(pc), "%03X", finding.pc);
+  std::lock_guard<std::mutex> lock(findings_mtx);
+  std::cout << "Found " << Chip8::fault_name(Chip8::Fault(finding.fault))
+            << " fault in " << opcode_name(finding.opcode) << " at " << pc
+            << " (" << input.rom.size() << " bytes, " << input.keys.size()
+            << " key events); replay with -l " << options.cycles
+            << " --keys " << path << ".keys " << path << ".ch8" << std::endl;
+}
+
+void Fuzzer::save(const std::string &dir, const std::string &name,
+                  const Input &input) const {
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  std::string path = dir + "/" + name;
+  std::ofstream rom(path + ".ch8", std::ios::binary);
+  rom.write(reinterpret_cast<const char *>(input.rom.data()),
+            input.rom.size());
+  std::ofstream keys(path + ".keys");
+  for (auto &ev : input.keys)
+    keys << ev.cycle << ' ' << std::hex << unsigned(ev.key) << std::dec << ' '
+         << (ev.pressed ? 'D' : 'U') << '\n';
+}
+
+void Fuzzer::load_corpus() {
+  if (options.corpus_dir.empty())
+    return;
+  std::error_code ec;
+  for (auto &entry :
+       std::filesystem::directory_iterator(options.corpus_dir, ec)) {
+    if (entry.path().extension() != ".ch8")
+      continue;
+    std::ifstream file(entry.path(), std::ios::binary);
+    Input input;
+    input.rom.assign(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+    if (input.rom.size() > max_rom_size)
+      continue;
+    auto keys = entry.path();
+    Lockstep::load_events(keys.replace_extension(".keys").string(),
+                          input.keys);
+    std::stable_sort(
+        input.keys.begin(), input.keys.end(),
+        [](const Lockstep::KeyEvent &a, const Lockstep::KeyEvent &b) {
+          return a.cycle < b.cycle;
+        });
+    corpus.push_back(std::move(input));
+  }
+}
+
+void Fuzzer::print_stats(double elapsed) {
+  size_t corpus_size, finding_count;
+  {
+    std::lock_guard<std::mutex> lock(corpus_mtx);
+    corpus_size = corpus.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(findings_mtx);
+    finding_count = found.size();
+  }
+  char line[128];
+  snprintf(line, sizeof(line),
+           "[%4.0fs] %llu execs (%.0f/s), corpus %zu, edges %u, findings %zu",
+           elapsed, (unsigned long long)execs.load(),
+           elapsed > 0 ? execs / elapsed : 0.0, corpus_size, edges.load(),
+           finding_count);
+  std::cout << line << std::endl;
+}
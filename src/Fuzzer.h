@@ -0,0 +1,93 @@
+#ifndef FUZZER_H
+#define FUZZER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Chip8.h"
+#include "Lockstep.h"
+
+// Coverage-guided fuzzer for the interpreter. Inputs are a ROM image plus a
+// key event script; they are mutated, run for a bounded number of cycles,
+// and kept in the corpus whenever they reach control flow edges (or edge hit
+// counts) not seen before. Executions that raise a Chip8::Fault are findings:
+// each distinct fault and faulting instruction is minimized and written out
+// as a ROM and a key file that "-l cycles --keys file" replays.
+class Fuzzer {
+public:
+  struct Options {
+    std::string corpus_dir;  // optional; loaded on start, new entries saved
+    std::string crashes_dir = "crashes";
+    unsigned threads = 0;    // one per hardware thread
+    double seconds = 60;
+    unsigned cycles = 2000;  // per execution
+    unsigned seed = 1;
+  };
+
+  struct Input {
+    std::vector<uint8_t> rom;
+    std::vector<Lockstep::KeyEvent> keys; // sorted by cycle
+  };
+
+  Fuzzer(const Options &, const uint8_t *rom, uint16_t rom_size);
+
+  // Fuzzes for the configured time, printing statistics once a second.
+  void run();
+
+  uint64_t executions() const;
+  size_t findings() const;
+
+private:
+  // PC, opcode and edge hit counts of one execution. Only the touched
+  // entries are cleared between executions.
+  struct Trace {
+    std::vector<uint8_t> hits;
+    std::vector<uint32_t> touched;
+    Trace();
+  };
+
+  // A fault and the kind of instruction that raised it, e.g. Fx55 writing
+  // past the end of memory. Reproducers are kept for the first of each.
+  struct Finding {
+    uint8_t fault;
+    uint16_t opcode; // operand bits cleared
+    uint16_t pc;     // not part of the identity
+    bool operator<(const Finding &o) const {
+      return std::make_pair(fault, opcode) < std::make_pair(o.fault, o.opcode);
+    }
+  };
+
+  Options options;
+  std::mutex corpus_mtx;
+  std::vector<Input> corpus;
+  // Hit count classes seen so far for each counter, one bit per class.
+  std::unique_ptr<std::atomic<uint8_t>[]> virgin;
+  std::atomic<uint64_t> execs;
+  std::atomic<unsigned> edges;
+  std::mutex findings_mtx;
+  std::set<Finding> found;
+
+  void worker(unsigned index);
+  void mutate(Input &, std::minstd_rand &);
+  // Runs an input on the given machine, recording coverage into the trace
+  // if one is given and the first instruction to raise each fault bit into
+  // findings.
+  uint8_t execute(Chip8 &, const Input &, Trace *, Finding findings[8]) const;
+  bool merge(Trace &);
+  bool reproduces(Chip8 &, const Input &, const Finding &) const;
+  void minimize(Chip8 &, Input &, const Finding &) const;
+  void report(const Input &, const Finding &);
+  void save(const std::string &dir, const std::string &name,
+            const Input &) const;
+  void load_corpus();
+  void print_stats(double elapsed);
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "GridView.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Window size the tiles are scaled to fit at start, in pixels.
+static const unsigned initial_width = 1280;
+// Fraction of a cell left empty around each tile.
+static const float tile_gap = 0.06f;
+
+GridView::GridView(unsigned count)
+    : instances(count), screens(size_t(count) * 32), window(nullptr),
+      ctx(nullptr), program_id(0), vertex_array(0), texture(0),
+      grid_location(-1), error(false), fps_start(0), fps_frames(0) {
+  // Displays are twice as wide as high, so twice as many rows as columns
+  // make a roughly square grid.
+  columns = std::max(1u, unsigned(std::ceil(std::sqrt(count / 2.0))));
+  rows = std::max(1u, (count + columns - 1) / columns);
+
+  std::stringstream ss;
+  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) {
+    error = true;
+    ss << "SDL_Init failed: " << SDL_GetError();
+    err = ss.str();
+    SDL_Quit();
+    return;
+  }
+  if (!init_gl()) {
+    error = true;
+    SDL_Quit();
+  }
+}
+
+GridView::~GridView() {
+  if (error)
+    return;
+  glDeleteTextures(1, &texture);
+  glDeleteVertexArrays(1, &vertex_array);
+  glDeleteProgram(program_id);
+  SDL_GL_DeleteContext(ctx);
+  SDL_DestroyWindow(window);
+  SDL_Quit();
+}
+
+bool GridView::init_gl() {
+  std::stringstream ss;
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+
+  unsigned scale = std::max(1u, initial_width / (columns * 64));
+  window = SDL_CreateWindow("Chip8 grid", SDL_WINDOWPOS_UNDEFINED,
+                            SDL_WINDOWPOS_UNDEFINED, columns * 64 * scale,
+                            rows * 32 * scale,
+                            SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL |
+                                SDL_WINDOW_RESIZABLE);
+  if (!window) {
+    ss << "SDL_CreateWindow failed: " << SDL_GetError();
+    err = ss.str();
+    return false;
+  }
+  ctx = SDL_GL_CreateContext(window);
+  if (!ctx) {
+    ss << "SDL_GL_CreateContext failed: " << SDL_GetError();
+    err = ss.str();
+    SDL_DestroyWindow(window);
+    return false;
+  }
+  SDL_GL_MakeCurrent(window, ctx);
+  SDL_GL_SetSwapInterval(1);
+
+  glewExperimental = GL_TRUE;
+  if (glewInit() != GLEW_OK) {
+    err = "glewInit failed!";
+    SDL_GL_DeleteContext(ctx);
+    SDL_DestroyWindow(window);
+    return false;
+  }
+
+  GLint max_layers = 0;
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+  program_id = load_shaders();
+  if (!program_id || instances > unsigned(max_layers)) {
+    if (program_id) {
+      ss << "At most " << max_layers << " instances fit in a texture array";
+      err = ss.str();
+      glDeleteProgram(program_id);
+    }
+    SDL_GL_DeleteContext(ctx);
+    SDL_DestroyWindow(window);
+    return false;
+  }
+  glUseProgram(program_id);
+  grid_location = glGetUniformLocation(program_id, "grid");
+  glUniform1i(glGetUniformLocation(program_id, "screens"), 0);
+  glUniform1f(glGetUniformLocation(program_id, "gap"), tile_gap);
+
+  // The quad's corners come from gl_VertexID, but core profiles still need
+  // a vertex array bound to draw.
+  glGenVertexArrays(1, &vertex_array);
+  glBindVertexArray(vertex_array);
+
+  // Each layer is one display: 32 rows of two 32-bit texels, exactly the
+  // in-memory layout of the uint64_t rows.
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32UI, 2, 32, instances, 0,
+               GL_RED_INTEGER, GL_UNSIGNED_INT, screens.data());
+
+  fps_start = SDL_GetTicks();
+  std::cout << "Showing " << instances << " instances in " << columns << "x"
+            << rows << " tiles" << std::endl;
+  return true;
+}
+
+GLuint GridView::compile_shader(GLenum type, const char *path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    err = std::string("Cannot open shader ") + path;
+    return 0;
+  }
+  std::stringstream ss;
+  ss << file.rdbuf();
+  std::string source = ss.str();
+  const char *source_ptr = source.c_str();
+
+  GLuint shader_id = glCreateShader(type);
+  glShaderSource(shader_id, 1, &source_ptr, nullptr);
+  glCompileShader(shader_id);
+  GLint result = GL_FALSE;
+  glGetShaderiv(shader_id, GL_COMPILE_STATUS, &result);
+  if (result != GL_TRUE) {
+    char log[1024];
+    glGetShaderInfoLog(shader_id, sizeof(log), nullptr, log);
+    err = std::string("Cannot compile ") + path + ": " + log;
+    glDeleteShader(shader_id);
+    return 0;
+  }
+  return shader_id;
+}
+
+GLuint GridView::load_shaders() {
+  GLuint vshader_id = compile_shader(GL_VERTEX_SHADER, "shaders/grid.vs");
+  if (!vshader_id)
+    return 0;
+  GLuint fshader_id = compile_shader(GL_FRAGMENT_SHADER, "shaders/grid.fs");
+  if (!fshader_id) {
+    glDeleteShader(vshader_id);
+    return 0;
+  }
+
+  GLuint program_id = glCreateProgram();
+  glAttachShader(program_id, vshader_id);
+  glAttachShader(program_id, fshader_id);
+  glLinkProgram(program_id);
+  glDetachShader(program_id, vshader_id);
+  glDetachShader(program_id, fshader_id);
+  glDeleteShader(vshader_id);
+  glDeleteShader(fshader_id);
+
+  GLint result = GL_FALSE;
+  glGetProgramiv(program_id, GL_LINK_STATUS, &result);
+  if (result != GL_TRUE) {
+    char log[1024];
+    glGetProgramInfoLog(program_id, sizeof(log), nullptr, log);
+    err = std::string("Cannot link the grid shaders: ") + log;
+    glDeleteProgram(program_id);
+    return 0;
+  }
+  return program_id;
+}
+
+bool GridView::error_occurred() const { return error; }
+
+std::string GridView::error_message() const { return err; }
+
+unsigned GridView::count() const { return instances; }
+
+uint64_t (&GridView::screen(unsigned i))[32] {
+  return *reinterpret_cast<uint64_t(*)[32]>(&screens[size_t(i) * 32]);
+}
+
+bool GridView::poll() {
+  SDL_Event event;
+  while (SDL_PollEvent(&event)) {
+    if (event.type == SDL_QUIT ||
+        (event.type == SDL_WINDOWEVENT &&
+         event.window.event == SDL_WINDOWEVENT_CLOSE))
+      return false;
+  }
+  return true;
+}
+
+void GridView::present(bool changed) {
+  if (changed)
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, 2, 32, instances,
+                    GL_RED_INTEGER, GL_UNSIGNED_INT, screens.data());
+
+  int width, height;
+  SDL_GL_GetDrawableSize(window, &width, &height);
+  glViewport(0, 0, width, height);
+  glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glUniform2i(grid_location, columns, rows);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instances);
+  SDL_GL_SwapWindow(window);
+
+  ++fps_frames;
+  Uint32 now = SDL_GetTicks();
+  if (now - fps_start >= 1000) {
+    char title[64];
+    snprintf(title, sizeof(title), "Chip8 grid: %u instances, %.1f FPS",
+             instances, fps_frames * 1000.0 / (now - fps_start));
+    SDL_SetWindowTitle(window, title);
+    fps_start = now;
+    fps_frames = 0;
+  }
+}
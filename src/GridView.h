@@ -0,0 +1,59 @@
+#ifndef GRIDVIEW_H
+#define GRIDVIEW_H
+
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One window showing the displays of many machines side by side, for
+// watching a whole farm of sessions at once. The packed displays (256 bytes
+// each) are uploaded together into one layer per machine of an integer
+// texture array, and all tiles are drawn by a single instanced draw call
+// that unpacks the pixels in the fragment shader, so the cost per frame is
+// one upload and one draw regardless of the number of machines.
+class GridView {
+public:
+  explicit GridView(unsigned count);
+  ~GridView();
+  GridView(const GridView &) = delete;
+  GridView &operator=(const GridView &) = delete;
+
+  bool error_occurred() const;
+  std::string error_message() const;
+
+  unsigned count() const;
+  // Where the display of machine i is copied before present(). Different
+  // machines may be copied from different threads.
+  uint64_t (&screen(unsigned i))[32];
+
+  // Handles window events; false once the window has been closed.
+  bool poll();
+  // Draws every tile, uploading the screens first if any of them changed,
+  // and waits for vertical sync.
+  void present(bool changed);
+
+private:
+  unsigned instances;
+  unsigned columns, rows;
+  std::vector<uint64_t> screens; // 32 rows per machine
+  SDL_Window *window;
+  SDL_GLContext ctx;
+  GLuint program_id;
+  GLuint vertex_array;
+  GLuint texture;
+  GLint grid_location;
+  bool error;
+  std::string err;
+  // Presented frames per second, shown in the title.
+  Uint32 fps_start;
+  unsigned fps_frames;
+
+  bool init_gl();
+  GLuint compile_shader(GLenum type, const char *path);
+  GLuint load_shaders();
+};
+
+#endif
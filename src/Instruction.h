@@ -25,7 +25,7 @@ struct Instruction {
 
   // const uint16_t w0;
 
-  Instruction(int16_t data)
+  constexpr Instruction(uint16_t data)
       : // : h0(data & halfMask), h1(data >> 4 & halfMask), h2(data >> 8 &
         // halfMask),
         //   h3(data >> 12 & halfMask),
@@ -39,13 +39,44 @@ struct Instruction {
         data(data) {}
 
 public:
-  uint16_t inst() const { return data; }
-  uint16_t address() const { return data & addressMask; }
-  uint16_t byte() const { return data & byteMask; }
-  uint8_t x() const { return data >> 8 & halfMask; }
-  uint8_t y() const { return data >> 4 & halfMask; }
-  uint8_t nibble() const { return data & halfMask; }
-  uint8_t hnibble() const { return data >> 12 & halfMask; }
+  // How an instruction passes control on, for analyses that follow a
+  // program without running it.
+  enum Flow {
+    Next,        // falls through to the following instruction
+    Jump,        // 1nnn
+    Call,        // 2nnn, returns to the following instruction
+    Return,      // 00EE
+    Skip,        // 3xkk 4xkk 5xy0 9xy0 Ex9E ExA1: next or the one after
+    JumpIndexed, // Bnnn, somewhere in nnn..nnn+FF
+  };
+
+  constexpr uint16_t inst() const { return data; }
+  constexpr uint16_t address() const { return data & addressMask; }
+  constexpr uint16_t byte() const { return data & byteMask; }
+  constexpr uint8_t x() const { return data >> 8 & halfMask; }
+  constexpr uint8_t y() const { return data >> 4 & halfMask; }
+  constexpr uint8_t nibble() const { return data & halfMask; }
+  constexpr uint8_t hnibble() const { return data >> 12 & halfMask; }
+  constexpr Flow flow() const {
+    switch (hnibble()) {
+    case 0x0:
+      return data == 0x00EE ? Return : Next;
+    case 0x1:
+      return Jump;
+    case 0x2:
+      return Call;
+    case 0x3:
+    case 0x4:
+    case 0x5:
+    case 0x9:
+      return Skip;
+    case 0xB:
+      return JumpIndexed;
+    case 0xE:
+      return byte() == 0x9E || byte() == 0xA1 ? Skip : Next;
+    }
+    return Next;
+  }
 
 private:
   static constexpr int16_t halfMask = 0x000f;
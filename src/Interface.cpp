@@ -1,6 +1,75 @@
 #include "Interface.h"
+#include "Netplay.h"
+#include "SharedFrame.h"
 
-Interface::Interface(Chip8& emu, int argc, char* args[]): emulator(emu) {
+Interface::Interface(Chip8& emu, int argc, char* args[]): emulator(emu),
+    netplay(nullptr), run_ahead_frames(0), run_ahead_cycles(0),
+    shared_frame(nullptr), shared_frame_cycles(0), trace(nullptr),
+    frame_cycles(0), cycles(0) {
+}
+
+void Interface::set_frame_cycles(unsigned cycles_per_frame) {
+    frame_cycles = cycles_per_frame;
+}
+
+void Interface::set_run_ahead(unsigned frames, unsigned cycles_per_frame) {
+    run_ahead_frames = frames;
+    run_ahead_cycles = cycles_per_frame;
+    metrics.input_latency().follow_run_ahead(frames > 0);
+}
+
+void Interface::set_netplay(Netplay *session) {
+    netplay = session;
+}
+
+void Interface::set_shared_frame(SharedFrame *frame, unsigned cycles_per_frame) {
+    shared_frame = frame;
+    shared_frame_cycles = cycles_per_frame;
+}
+
+void Interface::set_trace(Trace::Recorder *recorder) {
+    trace = recorder;
+}
+
+Metrics &Interface::get_metrics() {
+    return metrics;
+}
+
+bool Interface::step() {
+    if (netplay) {
+        if (!netplay->cycle())
+            return false;
+        metrics.instruction_retired();
+    } else {
+        Instruction inst = trace ? trace->cycle(emulator) : emulator.cycle();
+        // cycle() returns a null instruction while waiting for a key
+        if (inst.inst())
+            metrics.instruction_retired();
+        metrics.input_latency().executed(inst, emulator);
+    }
+    // Frames are counted here rather than when they are shown, which can
+    // be less often than they are emulated.
+    ++cycles;
+    if (frame_cycles && cycles % frame_cycles == 0)
+        metrics.emulated_frame();
+    if (shared_frame && cycles % shared_frame_cycles == 0)
+        shared_frame->publish(emulator, cycles);
+    return true;
+}
+
+void Interface::key_event(uint8_t key, bool pressed) {
+    metrics.input_event();
+    if (netplay) {
+        netplay->set_local_key(key, pressed);
+        return;
+    }
+    // Rollbacks replay inputs, so latency is only followed without netplay.
+    if (pressed) {
+        metrics.input_latency().press(key, emulator.waiting_for_input());
+        emulator.press_key(key);
+    } else {
+        emulator.release_key(key);
+    }
 }
 
 bool Interface::error_occurred() const {
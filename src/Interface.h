@@ -1,5 +1,19 @@
 #include "Chip8.h"
+#include "Metrics.h"
+#include "SoftRenderer.h"
+#include "Trace.h"
 #include <string>
+
+class Netplay;
+class SharedFrame;
+
+// How graphical interfaces draw the display.
+struct DisplayOptions {
+	// Draw on the CPU instead of through OpenGL.
+	bool software = false;
+	SoftRenderer::Options render;
+};
+
 class Interface {
 	public:
 		Interface(Chip8&, int, char* args[]);
@@ -7,6 +21,34 @@ class Interface {
 		virtual void update_screen() = 0;
 		virtual bool error_occurred() const;
 		virtual std::string error_message() const;
+		// Cycles in one emulated frame, for the emulated frame rate.
+		void set_frame_cycles(unsigned);
+		void set_run_ahead(unsigned frames, unsigned cycles_per_frame);
+		void set_netplay(Netplay *);
+		// Publishes the machine every cycles_per_frame cycles.
+		void set_shared_frame(SharedFrame *, unsigned cycles_per_frame);
+		// Records every executed instruction; not used under netplay.
+		void set_trace(Trace::Recorder *);
+		Metrics &get_metrics();
 	protected:
 		Chip8 &emulator;
+		// When set, cycles and local key events go through the netplay
+		// session instead of straight to the emulator.
+		Netplay *netplay;
+		Metrics metrics;
+		// Number of frames to speculatively emulate past the live state
+		// before presenting, 0 disables run-ahead.
+		unsigned run_ahead_frames;
+		unsigned run_ahead_cycles;
+		SharedFrame *shared_frame;
+		unsigned shared_frame_cycles;
+		Trace::Recorder *trace;
+		unsigned frame_cycles; // 0 until set, no frames are counted
+		uint64_t cycles;
+
+		// Runs one cycle. Returns false while netplay is stalled waiting for
+		// the peer, callers then back off before the next step without
+		// holding anything the display needs.
+		bool step();
+		void key_event(uint8_t key, bool pressed);
 };
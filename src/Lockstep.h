@@ -0,0 +1,62 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+
+// Differential checker that runs a candidate execution engine side by side
+// with the reference interpreter (Chip8::cycle()) on the same ROM and key
+// events, and compares the complete machine state between blocks.
+class Lockstep {
+public:
+  // Executes one block of at most the given number of cycles (at least
+  // one) and returns how many cycles it ran (at least one).
+  typedef unsigned (*Engine)(Chip8 &, unsigned);
+
+  struct KeyEvent {
+    uint64_t cycle; // applied before this cycle runs
+    uint8_t key;
+    bool pressed;
+  };
+
+  // Both machines at a point of a run, and the next key event due.
+  struct State {
+    Chip8 reference;
+    Chip8 candidate;
+    uint64_t cycle;
+    size_t next_event;
+  };
+
+  Lockstep(const uint8_t *rom, uint16_t rom_size, Engine candidate,
+           std::vector<KeyEvent> events);
+
+  // Runs the given number of cycles, comparing after every sample_every-th
+  // block. Returns false on the first divergence; report() then describes
+  // it.
+  bool run(uint64_t cycles, unsigned sample_every = 1);
+  std::string report() const;
+
+  // Candidate engines: the opcode_map dispatcher one instruction at a time,
+  // and the same dispatcher running whole basic blocks.
+  static unsigned dispatch_step(Chip8 &, unsigned);
+  static unsigned dispatch_block(Chip8 &, unsigned);
+
+  // Key event scripts: lines of "cycle key D|U", or random presses.
+  static bool load_events(const std::string &path, std::vector<KeyEvent> &);
+  static std::vector<KeyEvent> random_events(uint64_t cycles, unsigned seed);
+
+private:
+  State now;
+  Engine engine;
+  std::vector<KeyEvent> events;
+  uint64_t blocks;
+  std::string diverged;
+
+  void locate(const State &, uint64_t end);
+  static std::string diff(const Chip8 &, const Chip8 &);
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// The 4 KiB address space of a machine, see BasicChip8. Addresses passed in
+// are already wrapped to 0xFFF; read() never changes the memory, write()
+// returns the byte to store into.
+
+// Every machine owns all of its memory. Plain data, usable at compile time.
+class FlatMemory {
+private:
+  uint8_t bytes[0x1000]{};
+
+  friend class PagedMemory;
+
+public:
+  static constexpr uint8_t fontset[80] = {
+      0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+      0x20, 0x60, 0x20, 0x20, 0x70, // 1
+      0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+      0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+      0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+      0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+      0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+      0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+      0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+      0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+      0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+      0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+      0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+      0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+      0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+      0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+  };
+
+  // The fontset at 0, and the ROM at 0x200 unless it does not fit.
+  constexpr FlatMemory(const uint8_t *rom, uint16_t rom_size) {
+    std::copy_n(fontset, sizeof(fontset), bytes);
+    if (rom_size < 0x1000 - 0x200)
+      std::copy_n(rom, rom_size, bytes + 0x200);
+  }
+
+  constexpr uint8_t read(uint16_t address) const { return bytes[address]; }
+  constexpr uint8_t &write(uint16_t address) { return bytes[address]; }
+};
+
+// Memory shared by a pool of machines running the same ROM: reads go to a
+// read-only image (usually the memory of the machine the pool was started
+// from) until a page is first written, which then gets a private copy.
+// Games write to a handful of bytes (BCD digits, saved registers), so a
+// machine owns a few pages instead of 4 KiB, and the image stays in the
+// cache shared by all of them. The first pages taken are stored inline;
+// only machines that write all over memory spill pages to the heap.
+//
+// The image must outlive every machine sharing it. Copies of a machine
+// share the image and copy its private pages.
+class PagedMemory {
+public:
+  static constexpr unsigned page_size = 64;
+  static constexpr unsigned inline_pages = 2;
+
+private:
+  static constexpr unsigned page_count = 0x1000 / page_size;
+  static constexpr unsigned spill_pages = page_count - inline_pages;
+  typedef uint8_t Page[page_size];
+
+  const uint8_t *image;
+  // For each page, 0 while shared, else one more than its private slot.
+  uint8_t slots[page_count]{};
+  uint8_t private_count{};
+  Page pages[inline_pages]{};
+  // Room for every other page, allocated when the first one spills and
+  // never moved, so references returned by write() stay valid.
+  Page *spilled{};
+
+  constexpr const uint8_t *slot(unsigned index) const {
+    return index < inline_pages ? pages[index] : spilled[index - inline_pages];
+  }
+
+  constexpr uint8_t *slot(unsigned index) {
+    return index < inline_pages ? pages[index] : spilled[index - inline_pages];
+  }
+
+  // Copies a page out of the image and returns its slot.
+  constexpr unsigned take(unsigned page) {
+    unsigned index = private_count++;
+    if (index >= inline_pages && !spilled)
+      spilled = new Page[spill_pages]();
+    std::copy_n(image + page * page_size, page_size, slot(index));
+    slots[page] = index + 1;
+    return index;
+  }
+
+  constexpr void copy_from(const PagedMemory &other) {
+    image = other.image;
+    std::copy_n(other.slots, page_count, slots);
+    private_count = other.private_count;
+    for (unsigned i = 0; i < private_count; ++i) {
+      if (i >= inline_pages && !spilled)
+        spilled = new Page[spill_pages]();
+      std::copy_n(other.slot(i), page_size, slot(i));
+    }
+  }
+
+public:
+  constexpr explicit PagedMemory(const FlatMemory &shared)
+      : image(shared.bytes) {}
+  constexpr PagedMemory(const PagedMemory &other) { copy_from(other); }
+  constexpr PagedMemory &operator=(const PagedMemory &other) {
+    if (this != &other) {
+      delete[] spilled;
+      spilled = nullptr;
+      copy_from(other);
+    }
+    return *this;
+  }
+  constexpr ~PagedMemory() { delete[] spilled; }
+
+  constexpr uint8_t read(uint16_t address) const {
+    unsigned index = slots[address / page_size];
+    if (!index)
+      return image[address];
+    return slot(index - 1)[address % page_size];
+  }
+
+  constexpr uint8_t &write(uint16_t address) {
+    unsigned index = slots[address / page_size];
+    index = index ? index - 1 : take(address / page_size);
+    return slot(index)[address % page_size];
+  }
+
+  // Pages this machine owns, inline and spilled.
+  constexpr unsigned private_pages() const { return private_count; }
+};
+
+#endif
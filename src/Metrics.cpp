@@ -0,0 +1,385 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+static int64_t to_ns(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+static int64_t to_us(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+Histogram::Histogram() {
+  for (auto &bucket : buckets)
+    bucket.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::bucket_limit(int bucket) { return uint64_t(1) << bucket; }
+
+void Histogram::record(std::chrono::steady_clock::duration d) {
+  int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  int bucket = 0;
+  while (bucket < bucket_count - 1 && us > int64_t(bucket_limit(bucket)))
+    ++bucket;
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snap;
+  snap.count = 0;
+  for (int i = 0; i < bucket_count; ++i) {
+    snap.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    snap.count += snap.buckets[i];
+  }
+  return snap;
+}
+
+double Histogram::Snapshot::percentile(double fraction) const {
+  if (!count)
+    return 0;
+  uint64_t target = fraction * count;
+  uint64_t seen = 0;
+  for (int i = 0; i < bucket_count; ++i) {
+    seen += buckets[i];
+    if (seen > target)
+      return bucket_limit(i);
+  }
+  return bucket_limit(bucket_count - 1);
+}
+
+// Events tracked at each stage; older ones are dropped beyond this.
+static const size_t max_tracked_events = 64;
+// Events not read, or read but not drawn, within this time are given up on.
+static const std::chrono::seconds event_timeout(2);
+
+InputLatency::InputLatency()
+    : cycle(0), next_serial(0), run_ahead(false), ahead_cycle(0), unread(0),
+      invisible(0) {}
+
+void InputLatency::follow_run_ahead(bool enabled) { run_ahead = enabled; }
+
+void InputLatency::press(uint8_t key, bool completes_wait) {
+  clock::time_point now = clock::now();
+  expire(now);
+  if (pending.size() >= max_tracked_events) {
+    ++unread;
+    pending.erase(pending.begin());
+  }
+  Event event{};
+  event.serial = next_serial++;
+  event.key = key;
+  event.input_time = now;
+  event.input_cycle = cycle;
+  if (completes_wait) {
+    // Fx0A stores the key as it is pressed; the next cycle runs with it.
+    event.read = true;
+    event.read_time = now;
+    event.read_cycle = cycle + 1;
+  }
+  pending.push_back(event);
+}
+
+void InputLatency::track(Instruction inst, const Chip8 &emu,
+                         uint64_t at_cycle, std::vector<Event> &from,
+                         std::vector<Event> &to) {
+  if (inst.hnibble() == 0xE &&
+      (inst.byte() == 0x9E || inst.byte() == 0xA1)) {
+    uint8_t key = emu.V(inst.x()) & 15;
+    clock::time_point now;
+    for (Event &event : from) {
+      if (event.read || event.key != key)
+        continue;
+      if (now == clock::time_point())
+        now = clock::now();
+      event.read = true;
+      event.read_time = now;
+      event.read_cycle = at_cycle;
+    }
+  } else if (inst.hnibble() == 0xD) {
+    // Drawing XORs the sprite in, so any set bit changes a pixel.
+    uint16_t I = emu.refI(Chip8::Chip8I);
+    bool changed = false;
+    for (unsigned i = 0; i < inst.nibble(); ++i)
+      changed |= emu.peek((I + i) & 0xFFF) != 0;
+    if (!changed)
+      return;
+    clock::time_point now = clock::now();
+    size_t kept = 0;
+    for (Event &event : from) {
+      if (!event.read) {
+        from[kept++] = event;
+        continue;
+      }
+      event.draw_time = now;
+      event.draw_cycle = at_cycle;
+      if (to.size() < max_tracked_events)
+        to.push_back(event);
+    }
+    from.resize(kept);
+  }
+}
+
+void InputLatency::expire(clock::time_point now) {
+  size_t kept = 0;
+  for (Event &event : pending) {
+    if (now - event.input_time < event_timeout)
+      pending[kept++] = event;
+    else if (event.read)
+      ++invisible;
+    else
+      ++unread;
+  }
+  pending.resize(kept);
+}
+
+void InputLatency::capture() {
+  for (Event &event : drawn) {
+    if (captured.size() < max_tracked_events)
+      captured.push_back(event);
+  }
+  drawn.clear();
+}
+
+void InputLatency::begin_ahead() {
+  // Presses shown by the previous run are done. A press only read there is
+  // read for good: the live machine has run past the read or will repeat
+  // it, and either way the next draw after it shows the effect.
+  size_t kept = 0;
+  for (Event &event : pending) {
+    if (std::find(ahead_presented.begin(), ahead_presented.end(),
+                  event.serial) != ahead_presented.end())
+      continue;
+    for (const Event &speculated : ahead) {
+      if (speculated.serial == event.serial && speculated.read &&
+          !event.read) {
+        event.read = true;
+        event.read_time = speculated.read_time;
+        event.read_cycle = speculated.read_cycle;
+      }
+    }
+    pending[kept++] = event;
+  }
+  pending.resize(kept);
+  ahead_presented.clear();
+  expire(clock::now());
+  ahead = pending;
+  ahead_drawn.clear();
+  ahead_cycle = cycle;
+}
+
+void InputLatency::end_ahead() {
+  for (Event &event : ahead_drawn) {
+    ahead_presented.push_back(event.serial);
+    if (captured.size() < max_tracked_events)
+      captured.push_back(event);
+  }
+  ahead_drawn.clear();
+}
+
+void InputLatency::presented() {
+  if (captured.empty())
+    return;
+  clock::time_point now = clock::now();
+  for (Event &event : captured) {
+    event_to_photon.record(now - event.input_time);
+    event_to_read.record(event.read_time - event.input_time);
+    read_to_photon.record(now - event.read_time);
+    if (!log.is_open())
+      continue;
+    log << to_us(event.input_time - log_start) / 1000 << ' ' << std::hex
+        << unsigned(event.key) << std::dec << ' ' << event.input_cycle << ' '
+        << event.read_cycle << ' ' << event.draw_cycle << ' '
+        << to_us(event.read_time - event.input_time) << ' '
+        << to_us(event.draw_time - event.read_time) << ' '
+        << to_us(now - event.draw_time) << ' '
+        << to_us(now - event.input_time) << '\n';
+  }
+  log.flush();
+  captured.clear();
+}
+
+void InputLatency::log_to(const std::string &path) {
+  log.open(path, std::ios::trunc);
+  log_start = clock::now();
+  log << "# ms key input_cycle read_cycle draw_cycle input_to_read_us "
+         "read_to_draw_us draw_to_photon_us event_to_photon_us\n";
+}
+
+InputLatency::Snapshot InputLatency::snapshot() const {
+  Snapshot snap;
+  snap.event_to_photon = event_to_photon.snapshot();
+  snap.event_to_read = event_to_read.snapshot();
+  snap.read_to_photon = read_to_photon.snapshot();
+  snap.unread = unread.load(std::memory_order_relaxed);
+  snap.invisible = invisible.load(std::memory_order_relaxed);
+  return snap;
+}
+
+Metrics::Metrics()
+    : instructions(0), emulated_frames(0), presented_frames(0),
+      texture_bytes(0), pending_input_ns(0), last_present(),
+      last_sample(clock::now()), sampled_instructions(0),
+      sampled_emulated_frames(0), sampled_presented_frames(0),
+      instructions_per_second(0), emulated_fps(0), presented_fps(0),
+      export_interval(0) {
+  for (auto &wait : lock_wait_ns)
+    wait.store(0, std::memory_order_relaxed);
+}
+
+void Metrics::instruction_retired() {
+  instructions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::emulated_frame() {
+  emulated_frames.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::input_event() {
+  int64_t expected = 0;
+  pending_input_ns.compare_exchange_strong(
+      expected, to_ns(clock::now().time_since_epoch()),
+      std::memory_order_relaxed);
+}
+
+void Metrics::frame_presented() {
+  clock::time_point now = clock::now();
+  presented_frames.fetch_add(1, std::memory_order_relaxed);
+  if (last_present != clock::time_point())
+    frame_time.record(now - last_present);
+  last_present = now;
+
+  int64_t input = pending_input_ns.exchange(0, std::memory_order_relaxed);
+  if (input)
+    input_to_present.record(now.time_since_epoch() -
+                            std::chrono::nanoseconds(input));
+}
+
+void Metrics::lock_wait(Lock lock, std::chrono::steady_clock::duration d) {
+  lock_wait_ns[lock].fetch_add(to_ns(d), std::memory_order_relaxed);
+}
+
+void Metrics::texture_upload(uint64_t bytes) {
+  texture_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+InputLatency &Metrics::input_latency() { return latency; }
+
+void Metrics::export_to(const std::string &path, double interval_seconds) {
+  export_path = path;
+  export_interval = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(interval_seconds));
+  last_export = clock::now();
+}
+
+void Metrics::sample() {
+  clock::time_point now = clock::now();
+  double elapsed = std::chrono::duration<double>(now - last_sample).count();
+  if (elapsed >= 1.0) {
+    uint64_t instr = instructions.load(std::memory_order_relaxed);
+    uint64_t emulated = emulated_frames.load(std::memory_order_relaxed);
+    uint64_t presented = presented_frames.load(std::memory_order_relaxed);
+    instructions_per_second = (instr - sampled_instructions) / elapsed;
+    emulated_fps = (emulated - sampled_emulated_frames) / elapsed;
+    presented_fps = (presented - sampled_presented_frames) / elapsed;
+    sampled_instructions = instr;
+    sampled_emulated_frames = emulated;
+    sampled_presented_frames = presented;
+    last_sample = now;
+  }
+
+  if (!export_path.empty() && now - last_export >= export_interval) {
+    write_export();
+    last_export = now;
+  }
+}
+
+Metrics::Snapshot Metrics::snapshot() const {
+  Snapshot snap;
+  snap.instructions_per_second = instructions_per_second;
+  snap.emulated_fps = emulated_fps;
+  snap.presented_fps = presented_fps;
+  snap.instructions = instructions.load(std::memory_order_relaxed);
+  snap.texture_bytes = texture_bytes.load(std::memory_order_relaxed);
+  for (int i = 0; i < LockCount; ++i)
+    snap.lock_wait_ms[i] =
+        lock_wait_ns[i].load(std::memory_order_relaxed) / 1000000.0;
+  snap.frame_time = frame_time.snapshot();
+  snap.input_to_present = input_to_present.snapshot();
+  snap.latency = latency.snapshot();
+  return snap;
+}
+
+const char *Metrics::lock_name(Lock lock) {
+  switch (lock) {
+  case EmuLock:
+    return "emu_mtx";
+  case SdlLock:
+    return "sdl_mtx";
+  case LockCount:
+    break;
+  }
+  return "";
+}
+
+static void histogram_json(std::ostream &out, const char *name,
+                           const Histogram::Snapshot &hist) {
+  out << "  \"" << name << "\": {\"count\": " << hist.count
+      << ", \"p50_us\": " << hist.percentile(0.5)
+      << ", \"p90_us\": " << hist.percentile(0.9)
+      << ", \"p99_us\": " << hist.percentile(0.99) << ", \"buckets_us\": {";
+  bool first = true;
+  for (int i = 0; i < Histogram::bucket_count; ++i) {
+    if (!hist.buckets[i])
+      continue;
+    out << (first ? "" : ", ") << "\"" << Histogram::bucket_limit(i)
+        << "\": " << hist.buckets[i];
+    first = false;
+  }
+  out << "}}";
+}
+
+std::string Metrics::to_json() const {
+  Snapshot snap = snapshot();
+  std::stringstream out;
+  out << "{\n"
+      << "  \"instructions\": " << snap.instructions << ",\n"
+      << "  \"instructions_per_second\": " << snap.instructions_per_second
+      << ",\n"
+      << "  \"emulated_fps\": " << snap.emulated_fps << ",\n"
+      << "  \"presented_fps\": " << snap.presented_fps << ",\n"
+      << "  \"texture_upload_bytes\": " << snap.texture_bytes << ",\n"
+      << "  \"lock_wait_ms\": {";
+  for (int i = 0; i < LockCount; ++i) {
+    out << (i ? ", " : "") << "\"" << lock_name(Lock(i))
+        << "\": " << snap.lock_wait_ms[i];
+  }
+  out << "},\n";
+  histogram_json(out, "frame_time", snap.frame_time);
+  out << ",\n";
+  histogram_json(out, "input_to_present", snap.input_to_present);
+  out << ",\n";
+  histogram_json(out, "event_to_photon", snap.latency.event_to_photon);
+  out << ",\n";
+  histogram_json(out, "event_to_read", snap.latency.event_to_read);
+  out << ",\n";
+  histogram_json(out, "read_to_photon", snap.latency.read_to_photon);
+  out << ",\n"
+      << "  \"unread_inputs\": " << snap.latency.unread << ",\n"
+      << "  \"invisible_inputs\": " << snap.latency.invisible << "\n}\n";
+  return out.str();
+}
+
+void Metrics::write_export() {
+  // Write next to the target and rename, so a scraper never sees a
+  // partially written file.
+  std::string tmp = export_path + ".tmp";
+  std::ofstream out(tmp, std::ios::trunc);
+  if (!out.is_open())
+    return;
+  out << to_json();
+  out.close();
+  std::rename(tmp.c_str(), export_path.c_str());
+}
@@ -0,0 +1,198 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+
+// Latency histogram with power-of-two microsecond buckets. Recording is a
+// single relaxed atomic increment, so it can be shared between threads.
+class Histogram {
+public:
+  static constexpr int bucket_count = 24; // up to ~16 s
+
+  Histogram();
+  void record(std::chrono::steady_clock::duration);
+
+  struct Snapshot {
+    uint64_t buckets[bucket_count];
+    uint64_t count;
+    // Upper bound of the bucket holding the given fraction of samples, in
+    // microseconds.
+    double percentile(double) const;
+  };
+  Snapshot snapshot() const;
+
+  // Upper bound of a bucket in microseconds.
+  static uint64_t bucket_limit(int);
+
+private:
+  std::atomic<uint64_t> buckets[bucket_count];
+};
+
+// Follows each key press through the machine to the screen: the cycle at
+// which the ROM first reads the key (Ex9E/ExA1 on it, or Fx0A taking the
+// press), the first draw after that which changes pixels, and the present
+// of the frame holding that draw. Releases are not followed.
+//
+// press() and executed() are called on the emulation thread. capture() is
+// called when the frame to present is taken from the machine, with the
+// emulation thread held off; presented() right after the frame is swapped.
+//
+// With run-ahead the frame presented comes from a speculative copy of the
+// machine, so presses are followed there instead of in the live machine:
+// begin_ahead() replaces capture() when the copy is taken, executed_ahead()
+// follows each cycle run on the copy and end_ahead() is called once the
+// frame has been taken from it, all on the render thread.
+class InputLatency {
+public:
+  InputLatency();
+
+  // Set before the emulation starts.
+  void follow_run_ahead(bool);
+  // completes_wait: the machine is in Fx0A and takes this press.
+  void press(uint8_t key, bool completes_wait);
+  void executed(Instruction inst, const Chip8 &emu) {
+    ++cycle;
+    if (pending.empty() || run_ahead)
+      return;
+    if ((cycle & 0xFFF) == 0)
+      expire(clock::now());
+    track(inst, emu, cycle, pending, drawn);
+  }
+  void capture();
+  void begin_ahead();
+  void executed_ahead(Instruction inst, const Chip8 &emu) {
+    ++ahead_cycle;
+    if (!ahead.empty())
+      track(inst, emu, ahead_cycle, ahead, ahead_drawn);
+  }
+  void end_ahead();
+  void presented();
+
+  // Appends one line per presented event to the file.
+  void log_to(const std::string &path);
+
+  struct Snapshot {
+    Histogram::Snapshot event_to_photon;
+    Histogram::Snapshot event_to_read;
+    Histogram::Snapshot read_to_photon;
+    // Events the ROM never read, and events read without a visible effect.
+    uint64_t unread;
+    uint64_t invisible;
+  };
+  Snapshot snapshot() const;
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct Event {
+    uint32_t serial;
+    uint8_t key;
+    bool read;
+    clock::time_point input_time, read_time, draw_time;
+    uint64_t input_cycle, read_cycle, draw_cycle;
+  };
+
+  uint64_t cycle;
+  uint32_t next_serial;
+  bool run_ahead;
+  // Not drawn yet; only touched by the emulation thread, or with it held
+  // off.
+  std::vector<Event> pending;
+  // Drawn, waiting for the next capture().
+  std::vector<Event> drawn;
+  // In the frame being presented; only touched by the render thread.
+  std::vector<Event> captured;
+  // Copies of the pending presses followed through the run-ahead frames,
+  // those drawn there, and the serials of those presented since the last
+  // begin_ahead(); only touched by the render thread.
+  std::vector<Event> ahead, ahead_drawn;
+  std::vector<uint32_t> ahead_presented;
+  uint64_t ahead_cycle;
+  std::atomic<uint64_t> unread, invisible;
+  Histogram event_to_photon, event_to_read, read_to_photon;
+  std::ofstream log;
+  clock::time_point log_start;
+
+  // Marks presses in from read by the instruction, and moves those read
+  // before a visible draw to to.
+  static void track(Instruction, const Chip8 &, uint64_t at_cycle,
+                    std::vector<Event> &from, std::vector<Event> &to);
+  void expire(clock::time_point now);
+};
+
+// Runtime counters of the emulator and the frontend. Counters are updated
+// by the emulation and render threads; sample() turns them into per-second
+// rates and is meant to be called once per presented frame.
+class Metrics {
+public:
+  enum Lock { EmuLock, SdlLock, LockCount };
+
+  Metrics();
+
+  void instruction_retired();
+  void emulated_frame();
+  void input_event();
+  void frame_presented();
+  void lock_wait(Lock, std::chrono::steady_clock::duration);
+  void texture_upload(uint64_t bytes);
+  InputLatency &input_latency();
+
+  // Writes a JSON snapshot to the given file every interval.
+  void export_to(const std::string &path, double interval_seconds);
+  void sample();
+
+  struct Snapshot {
+    double instructions_per_second;
+    double emulated_fps;
+    double presented_fps;
+    uint64_t instructions;
+    uint64_t texture_bytes;
+    double lock_wait_ms[LockCount]; // total
+    Histogram::Snapshot frame_time;
+    Histogram::Snapshot input_to_present;
+    InputLatency::Snapshot latency;
+  };
+  Snapshot snapshot() const;
+  std::string to_json() const;
+
+  static const char *lock_name(Lock);
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  std::atomic<uint64_t> instructions;
+  std::atomic<uint64_t> emulated_frames;
+  std::atomic<uint64_t> presented_frames;
+  std::atomic<uint64_t> texture_bytes;
+  std::atomic<int64_t> lock_wait_ns[LockCount];
+  // Time of the oldest input event not yet followed by a present, 0 if none.
+  std::atomic<int64_t> pending_input_ns;
+  Histogram frame_time;
+  Histogram input_to_present;
+  InputLatency latency;
+
+  // Only touched by the thread calling frame_presented() and sample().
+  clock::time_point last_present;
+  clock::time_point last_sample;
+  uint64_t sampled_instructions;
+  uint64_t sampled_emulated_frames;
+  uint64_t sampled_presented_frames;
+  double instructions_per_second;
+  double emulated_fps;
+  double presented_fps;
+
+  std::string export_path;
+  clock::duration export_interval;
+  clock::time_point last_export;
+
+  void write_export();
+};
+
+#endif
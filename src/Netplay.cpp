@@ -0,0 +1,218 @@
+#include "Netplay.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Packet layout, little endian:
+//   u32 magic, u32 first frame, u32 first frame the sender still needs,
+//   u16 input count, u16 inputs[count]
+static const uint32_t packet_magic = 0x504E3843; // "C8NP"
+static const size_t header_size = 14;
+static const std::chrono::milliseconds resend_interval(16);
+
+static void put_u32(std::vector<uint8_t> &buf, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    buf.push_back(value >> (8 * i));
+}
+
+static void put_u16(std::vector<uint8_t> &buf, uint16_t value) {
+  buf.push_back(value);
+  buf.push_back(value >> 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+static uint16_t get_u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+Netplay::Netplay(Chip8 &emu, const Options &opts)
+    : emulator(emu), options(opts), sock(-1), error(false),
+      frames(max_rollback, Frame{emu, 0, 0}), local_keys(0), next_frame(0),
+      last_remote(-1), remote_needs(0), frame_cycle(0), rollback_count(0) {
+  std::stringstream ss;
+  memset(local_inputs, 0, sizeof(local_inputs));
+  memset(remote_inputs, 0, sizeof(remote_inputs));
+  if (options.frame_cycles == 0)
+    options.frame_cycles = 1;
+
+  addrinfo hints = {}, *res = nullptr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int rc = getaddrinfo(options.remote_host.c_str(), nullptr, &hints, &res);
+  if (rc != 0 || !res) {
+    error = true;
+    ss << "Cannot resolve " << options.remote_host << ": " << gai_strerror(rc);
+    err = ss.str();
+    return;
+  }
+  memcpy(&remote_addr, res->ai_addr, sizeof(remote_addr));
+  remote_addr.sin_port = htons(options.remote_port);
+  freeaddrinfo(res);
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    error = true;
+    ss << "socket failed: " << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(options.local_port);
+  if (bind(sock, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0) {
+    error = true;
+    ss << "Cannot bind UDP port " << options.local_port << ": "
+       << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+}
+
+Netplay::~Netplay() {
+  if (sock >= 0)
+    close(sock);
+}
+
+bool Netplay::error_occurred() const { return error; }
+
+std::string Netplay::error_message() const { return err; }
+
+void Netplay::set_local_key(uint8_t key, bool pressed) {
+  if (pressed)
+    local_keys |= 1 << key;
+  else
+    local_keys &= ~(1 << key);
+}
+
+uint32_t Netplay::frame() const { return next_frame; }
+
+uint32_t Netplay::rollbacks() const { return rollback_count; }
+
+bool Netplay::cycle() {
+  if (frame_cycle == 0 && !begin_frame())
+    return false;
+  emulator.cycle();
+  if (++frame_cycle == options.frame_cycles)
+    frame_cycle = 0;
+  return true;
+}
+
+bool Netplay::begin_frame() {
+  receive();
+
+  // The state of the oldest unconfirmed frame must still be in the ring
+  // once this frame's state is saved.
+  if (int64_t(next_frame) - last_remote > max_rollback) {
+    if (std::chrono::steady_clock::now() - last_send >= resend_interval)
+      send();
+    return false;
+  }
+
+  Frame &fr = frames[next_frame % max_rollback];
+  fr.state = emulator;
+  fr.local = local_keys;
+  fr.remote = remote_input(next_frame);
+  local_inputs[next_frame % input_window] = local_keys;
+  emulator.set_keys(fr.local | fr.remote);
+  ++next_frame;
+  send();
+  return true;
+}
+
+uint16_t Netplay::remote_input(uint32_t frame) const {
+  if (frame <= last_remote)
+    return remote_inputs[frame % input_window];
+  if (last_remote < 0)
+    return 0;
+  return remote_inputs[last_remote % input_window];
+}
+
+void Netplay::run_frame(uint32_t frame) {
+  Frame &fr = frames[frame % max_rollback];
+  fr.state = emulator;
+  fr.remote = remote_input(frame);
+  emulator.set_keys(fr.local | fr.remote);
+  for (unsigned i = 0; i < options.frame_cycles; ++i)
+    emulator.cycle();
+}
+
+void Netplay::rollback(uint32_t from) {
+  ++rollback_count;
+  emulator = frames[from % max_rollback].state;
+  for (uint32_t frame = from; frame < next_frame; ++frame)
+    run_frame(frame);
+}
+
+void Netplay::send() {
+  std::vector<uint8_t> packet;
+  uint32_t first = remote_needs;
+  if (next_frame - first > input_window)
+    first = next_frame - input_window;
+  put_u32(packet, packet_magic);
+  put_u32(packet, first);
+  put_u32(packet, last_remote + 1);
+  put_u16(packet, next_frame - first);
+  for (uint32_t frame = first; frame < next_frame; ++frame)
+    put_u16(packet, local_inputs[frame % input_window]);
+  last_send = std::chrono::steady_clock::now();
+
+  if (options.loss_percent && loss_engine() % 100 < options.loss_percent)
+    return;
+  sendto(sock, packet.data(), packet.size(), 0,
+         reinterpret_cast<const sockaddr *>(&remote_addr),
+         sizeof(remote_addr));
+}
+
+void Netplay::receive() {
+  auto now = std::chrono::steady_clock::now();
+  uint8_t buf[header_size + 2 * input_window];
+  ssize_t len;
+  while ((len = recv(sock, buf, sizeof(buf), 0)) > 0) {
+    incoming.emplace_back(now + std::chrono::milliseconds(options.delay_ms),
+                          std::vector<uint8_t>(buf, buf + len));
+  }
+
+  uint32_t mispredicted = UINT32_MAX;
+  while (!incoming.empty() && incoming.front().first <= now) {
+    mispredicted =
+        std::min(mispredicted, handle_packet(incoming.front().second));
+    incoming.pop_front();
+  }
+  if (mispredicted < next_frame)
+    rollback(mispredicted);
+}
+
+uint32_t Netplay::handle_packet(const std::vector<uint8_t> &packet) {
+  uint32_t mispredicted = UINT32_MAX;
+  if (packet.size() < header_size || get_u32(packet.data()) != packet_magic)
+    return mispredicted;
+  uint32_t first = get_u32(packet.data() + 4);
+  uint32_t needs = get_u32(packet.data() + 8);
+  uint16_t count = get_u16(packet.data() + 12);
+  if (packet.size() < header_size + 2 * count)
+    return mispredicted;
+
+  remote_needs = std::max(remote_needs, needs);
+  for (uint16_t i = 0; i < count; ++i) {
+    int64_t frame = int64_t(first) + i;
+    // Inputs are resent until confirmed, so anything but the next expected
+    // frame is either a duplicate or arrives again later.
+    if (frame != last_remote + 1)
+      continue;
+    uint16_t input = get_u16(packet.data() + header_size + 2 * i);
+    remote_inputs[frame % input_window] = input;
+    last_remote = frame;
+    if (frame < next_frame && frames[frame % max_rollback].remote != input)
+      mispredicted = std::min<uint32_t>(mispredicted, frame);
+  }
+  return mispredicted;
+}
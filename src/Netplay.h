@@ -0,0 +1,96 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "Chip8.h"
+
+// Rollback netplay for two-player ROMs. Both peers run the same ROM in
+// lockstep frames of a fixed number of cycles. The keypad of a frame is the
+// OR of both players' keys; the remote half is predicted (last confirmed
+// input repeated) until its confirmed input arrives over UDP. When a
+// prediction turns out wrong, the machine is restored to the saved state of
+// the mispredicted frame and re-simulated up to the current one.
+class Netplay {
+public:
+  struct Options {
+    uint16_t local_port = 0;
+    std::string remote_host;
+    uint16_t remote_port = 0;
+    unsigned frame_cycles = 10;
+    // Simulated one-way latency and packet loss, for testing on loopback.
+    unsigned delay_ms = 0;
+    unsigned loss_percent = 0;
+  };
+
+  Netplay(Chip8 &, const Options &);
+  ~Netplay();
+
+  bool error_occurred() const;
+  std::string error_message() const;
+
+  void set_local_key(uint8_t, bool);
+  // Runs one cycle of the shared machine. At frame boundaries this exchanges
+  // inputs and rolls back if needed; it returns false while stalled waiting
+  // for the remote peer. It never blocks, callers back off themselves.
+  bool cycle();
+
+  uint32_t frame() const;
+  uint32_t rollbacks() const;
+
+private:
+  // Frames that can be rolled back; the local side stalls rather than run
+  // further ahead of the last confirmed remote input.
+  static constexpr uint32_t max_rollback = 32;
+  // Inputs kept per side; the peers can drift up to twice max_rollback
+  // frames apart in each direction.
+  static constexpr uint32_t input_window = 4 * max_rollback;
+
+  struct Frame {
+    Chip8 state; // machine at the start of the frame
+    uint16_t local;
+    uint16_t remote; // remote input the frame was simulated with
+  };
+
+  Chip8 &emulator;
+  Options options;
+  int sock;
+  sockaddr_in remote_addr;
+  bool error;
+  std::string err;
+
+  std::vector<Frame> frames;
+  uint16_t local_inputs[input_window];
+  uint16_t remote_inputs[input_window];
+  uint16_t local_keys;
+  // Next frame to start, last remote frame confirmed by us and first local
+  // frame the peer has not confirmed yet.
+  uint32_t next_frame;
+  int64_t last_remote;
+  uint32_t remote_needs;
+  uint32_t frame_cycle;
+  uint32_t rollback_count;
+
+  std::minstd_rand loss_engine;
+  std::deque<std::pair<std::chrono::steady_clock::time_point,
+                       std::vector<uint8_t>>>
+      incoming;
+  std::chrono::steady_clock::time_point last_send;
+
+  bool begin_frame();
+  uint16_t remote_input(uint32_t) const;
+  void run_frame(uint32_t);
+  void rollback(uint32_t);
+  void send();
+  void receive();
+  uint32_t handle_packet(const std::vector<uint8_t> &);
+};
+
+#endif
@@ -1,14 +1,25 @@
 #include "SdlInterface.h"
-#include "imgui/imgui.h"
-#include "imgui/imgui_impl_opengl3.h"
-#include "imgui/imgui_impl_sdl.h"
+#include "Disasm.h"
+#include "Netplay.h"
 #include <SDL2/SDL_timer.h>
+#include <cfloat>
 #include <chrono>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <ostream>
 #include <sstream>
+#include <thread>
+#ifndef NO_GL
+#include "imgui/imgui.h"
+#include "imgui/imgui_impl_opengl3.h"
+#include "imgui/imgui_impl_sdl.h"
+#endif
 
+// How long the emulation thread waits while netplay is stalled.
+static const std::chrono::milliseconds stall_backoff(1);
+
+#ifndef NO_GL
 static const float vertices[] = {
     // position    textcoord
     -1, -1, 0.0, 0.0, 0.0,
@@ -19,10 +30,15 @@ static const float vertices[] = {
 
     1,  -1, 0.0, 1.0, 0.0,
 };
+#endif
 
-SdlInterface::SdlInterface(Chip8 &emu, int argc, char *args[])
+SdlInterface::SdlInterface(Chip8 &emu, int argc, char *args[],
+                           const DisplayOptions &display)
     : Interface(emu, argc, args), scale(10.0f), debug(false), emu_mtx(),
-      sdl_mtx(), closing(false) {
+      sdl_mtx(), closing(false), ahead(emu), ahead_start(emu),
+      ahead_ready(false), analysis(nullptr), frame(),
+      software(display.software), soft(display.render), renderer(nullptr),
+      frame_texture(nullptr), pace(false), next_present(0) {
   std::stringstream ss;
 
   error = false;
@@ -35,6 +51,23 @@ SdlInterface::SdlInterface(Chip8 &emu, int argc, char *args[])
     return;
   }
 
+#ifdef NO_GL
+  software = true;
+#else
+  if (!software && !init_gl()) {
+    std::cerr << err << ", falling back to software rendering" << std::endl;
+    software = true;
+  }
+#endif
+  if (software && !init_software()) {
+    error = true;
+    SDL_Quit();
+  }
+}
+
+#ifndef NO_GL
+bool SdlInterface::init_gl() {
+  std::stringstream ss;
   const char *glsl_version = "#version 130";
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 0);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
@@ -50,29 +83,26 @@ SdlInterface::SdlInterface(Chip8 &emu, int argc, char *args[])
                             SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL);
 
   if (!(window)) {
-    error = true;
     ss << "SDL_CreateWindow failed: " << SDL_GetError();
     err = ss.str();
-    SDL_Quit();
-    return;
+    return false;
   }
 
   ctx = SDL_GL_CreateContext(window);
   if (ctx == NULL) {
-    error = true;
     ss << "SDL_GL_CreateContext failed: " << SDL_GetError();
     err = ss.str();
-    return;
+    SDL_DestroyWindow(window);
+    return false;
   }
   SDL_GL_MakeCurrent(window, ctx);
   SDL_GL_SetSwapInterval(1);
 
   if (glewInit() != GLEW_OK) {
-    error = true;
     err = "glewInit failed!";
+    SDL_GL_DeleteContext(ctx);
     SDL_DestroyWindow(window);
-    SDL_Quit();
-    return;
+    return false;
   }
 
   std::cout << "Vendor: " << glGetString(GL_VENDOR) << std::endl
@@ -81,6 +111,14 @@ SdlInterface::SdlInterface(Chip8 &emu, int argc, char *args[])
             << std::endl
             << "Renderer: " << glGetString(GL_RENDERER) << std::endl;
 
+  program_id = load_shaders();
+  if (error_occurred()) {
+    error = false;
+    SDL_GL_DeleteContext(ctx);
+    SDL_DestroyWindow(window);
+    return false;
+  }
+
   IMGUI_CHECKVERSION();
   ImGui::SetCurrentContext(ImGui::CreateContext());
   ImGui::StyleColorsDark();
@@ -99,56 +137,104 @@ SdlInterface::SdlInterface(Chip8 &emu, int argc, char *args[])
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-  program_id = load_shaders();
-
-  if (error_occurred())
-    return;
-
   glUseProgram(program_id);
 
   glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  return true;
 }
+#endif
 
+bool SdlInterface::init_software() {
+  std::stringstream ss;
+  window = SDL_CreateWindow("Chip8 emulator", SDL_WINDOWPOS_UNDEFINED,
+                            SDL_WINDOWPOS_UNDEFINED, soft.width(),
+                            soft.height(), SDL_WINDOW_SHOWN);
+  if (!window) {
+    ss << "SDL_CreateWindow failed: " << SDL_GetError();
+    err = ss.str();
+    return false;
+  }
+
+  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+  if (!renderer) {
+    renderer = SDL_CreateRenderer(window, -1, 0);
+    pace = true;
+  }
+  if (renderer)
+    frame_texture =
+        SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                          SDL_TEXTUREACCESS_STREAMING, soft.width(),
+                          soft.height());
+  if (!frame_texture) {
+    ss << "Cannot create the software renderer: " << SDL_GetError();
+    err = ss.str();
+    if (renderer)
+      SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    return false;
+  }
+  std::cout << "Rendering in software at " << soft.width() << "x"
+            << soft.height() << std::endl;
+  return true;
+}
+
+#ifndef NO_GL
 void SdlInterface::gen_screentex() {
-  auto screen = emulator.get_display();
   for (int i = 0; i < 32; ++i) {
-    for (int j = 0; j < 64; ++j) {
-      if (screen[j][32 - i]) {
-        screenTex[i][j][0] = 255;
-        screenTex[i][j][1] = 255;
-        screenTex[i][j][2] = 255;
-      } else {
-        screenTex[i][j][0] = 0;
-        screenTex[i][j][1] = 0;
-        screenTex[i][j][2] = 0;
-      }
+    // Texture rows go bottom up
+    uint64_t row = frame[31 - i];
+    for (int j = 0; j < 64; ++j, row <<= 1) {
+      GLubyte value = row >> 63 ? 255 : 0;
+      screenTex[i][j][0] = value;
+      screenTex[i][j][1] = value;
+      screenTex[i][j][2] = value;
     }
   }
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 64, 32, 0, GL_RGB, GL_UNSIGNED_BYTE,
                screenTex);
+  metrics.texture_upload(sizeof(screenTex));
+}
+#endif
+
+void SdlInterface::lock(std::mutex &mtx, Metrics::Lock which) {
+  auto start = std::chrono::steady_clock::now();
+  mtx.lock();
+  metrics.lock_wait(which, std::chrono::steady_clock::now() - start);
 }
 
 bool SdlInterface::error_occurred() const { return error; }
 
 std::string SdlInterface::error_message() const { return err; }
 
+void SdlInterface::set_analysis(const Analysis *rom_analysis) {
+  analysis = rom_analysis;
+}
+
 bool SdlInterface::update() {
   auto start_time = std::chrono::steady_clock::now();
-  emu_mtx.lock();
-  emulator.cycle();
+  lock(emu_mtx, Metrics::EmuLock);
+  bool advanced = step();
   emu_mtx.unlock();
+  if (!advanced)
+    std::this_thread::sleep_for(stall_backoff);
   SDL_Event event;
   int8_t emukey;
 
   while (SDL_PollEvent(&event)) {
-    if (debug)
+#ifndef NO_GL
+    if (debug && !software)
       ImGui_ImplSDL2_ProcessEvent(&event);
+#endif
     switch (event.type) {
     case SDL_WINDOWEVENT:
       if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
         if (event.window.windowID == SDL_GetWindowID(window)) {
           closing = true;
           sdl_mtx.lock();
+          if (renderer) {
+            SDL_DestroyTexture(frame_texture);
+            SDL_DestroyRenderer(renderer);
+          }
           SDL_DestroyWindow(window);
           SDL_Quit();
           return false;
@@ -169,7 +255,7 @@ bool SdlInterface::update() {
         break;
       emukey = translate_key(event.key.keysym.sym);
       if (emukey != -1)
-        emulator.press_key(emukey);
+        send_key(emukey, true);
       break;
     case SDL_KEYUP:
       if (event.key.repeat)
@@ -180,7 +266,7 @@ bool SdlInterface::update() {
       }
       emukey = translate_key(event.key.keysym.sym);
       if (emukey != -1)
-        emulator.release_key(emukey);
+        send_key(emukey, false);
       break;
     }
   }
@@ -190,6 +276,13 @@ bool SdlInterface::update() {
   return true;
 }
 
+// Key events change the machine, which the render thread reads.
+void SdlInterface::send_key(uint8_t key, bool pressed) {
+  lock(emu_mtx, Metrics::EmuLock);
+  key_event(key, pressed);
+  emu_mtx.unlock();
+}
+
 int8_t SdlInterface::translate_key(const SDL_Keycode key) {
   if (key >= SDLK_KP_1 && key <= SDLK_KP_9) {
     return key - SDLK_KP_1 + 1;
@@ -218,8 +311,41 @@ int8_t SdlInterface::translate_key(const SDL_Keycode key) {
 void SdlInterface::update_screen() {
   if (closing)
     return;
-  sdl_mtx.lock();
+  lock(sdl_mtx, Metrics::SdlLock);
   Uint32 start_time = SDL_GetTicks();
+  bool changed = next_frame();
+#ifdef NO_GL
+  present_software(changed);
+#else
+  if (software)
+    present_software(changed);
+  else
+    present_gl(changed);
+#endif
+  metrics.frame_presented();
+  metrics.input_latency().presented();
+  metrics.sample();
+  render_time = SDL_GetTicks() - start_time;
+  sdl_mtx.unlock();
+}
+
+// Copies the display to be shown into frame, returning whether it changed.
+bool SdlInterface::next_frame() {
+  if (run_ahead_frames)
+    return run_ahead();
+  lock(emu_mtx, Metrics::EmuLock);
+  bool changed = emulator.screen_updated();
+  metrics.input_latency().capture();
+  if (changed) {
+    memcpy(frame, emulator.get_display(), sizeof(frame));
+    emulator.screen_update();
+  }
+  emu_mtx.unlock();
+  return changed;
+}
+
+#ifndef NO_GL
+void SdlInterface::present_gl(bool changed) {
   glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -228,12 +354,8 @@ void SdlInterface::update_screen() {
   glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float),
                         (void *)(3 * sizeof(float)));
   glEnableVertexAttribArray(1);
-  emu_mtx.lock();
-  if (emulator.screen_updated()) {
+  if (changed)
     gen_screentex();
-    emulator.screen_update();
-  }
-  emu_mtx.unlock();
 
   glDrawArrays(GL_QUADS, 0, 4);
   glDisableVertexAttribArray(0);
@@ -248,10 +370,67 @@ void SdlInterface::update_screen() {
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
   }
   SDL_GL_SwapWindow(window);
-  render_time = SDL_GetTicks() - start_time;
-  sdl_mtx.unlock();
+}
+#endif
+
+void SdlInterface::present_software(bool changed) {
+  // The phosphor blend keeps fading pixels out while the display is still.
+  if (changed || soft.fading()) {
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(frame_texture, nullptr, &pixels, &pitch) == 0) {
+      soft.render(frame, static_cast<uint32_t *>(pixels), pitch);
+      SDL_UnlockTexture(frame_texture);
+      metrics.texture_upload(size_t(soft.width()) * soft.height() * 4);
+    }
+  }
+  SDL_RenderClear(renderer);
+  SDL_RenderCopy(renderer, frame_texture, nullptr, nullptr);
+  SDL_RenderPresent(renderer);
+
+  if (pace) {
+    Uint32 now = SDL_GetTicks();
+    if (int32_t(next_present - now) > 0)
+      SDL_Delay(next_present - now);
+    else
+      next_present = now;
+    next_present += 1000 / 60;
+  }
 }
 
+// Returns whether the frame changed.
+bool SdlInterface::run_ahead() {
+  // Snapshot the live state and emulate the speculative frames on the copy
+  // with the current input. Only the last of them is shown, so the display
+  // is taken once instead of for every intermediate frame.
+  lock(emu_mtx, Metrics::EmuLock);
+  emulator.screen_update();
+  // Keys are part of the machine, so an unchanged machine (paused, or
+  // waiting for a key) would give the same speculative frames again.
+  // Chip8 has no padding (asserted in Chip8.h), so memcmp compares state.
+  bool changed =
+      !ahead_ready || memcmp(&ahead_start, &emulator, sizeof(Chip8)) != 0;
+  if (changed) {
+    ahead_start = emulator;
+    ahead = emulator;
+    ahead_ready = true;
+    // Presses are followed through the frames actually presented.
+    metrics.input_latency().begin_ahead();
+  }
+  emu_mtx.unlock();
+  if (!changed)
+    return false;
+
+  InputLatency &latency = metrics.input_latency();
+  const unsigned cycles = run_ahead_frames * run_ahead_cycles;
+  for (unsigned i = 0; i < cycles; ++i)
+    latency.executed_ahead(ahead.cycle(), ahead);
+  memcpy(frame, ahead.get_display(), sizeof(frame));
+  latency.end_ahead();
+  return true;
+}
+
+#ifndef NO_GL
 void SdlInterface::guiFrame() {
   ImGui::Begin("Registers");
   ImGui::Text("I: %03X", emulator.refI(Chip8::Internal::Chip8I));
@@ -260,14 +439,80 @@ void SdlInterface::guiFrame() {
     ImGui::Text("V%01X: %02X", i, emulator.V(i));
   }
   ImGui::End();
+  codeFrame();
   ImGui::Begin("Performance");
   ImGui::Text("Last render time: %d ms", render_time);
   ImGui::Text("Last tick time: %d ms", tick_time);
   ImGui::Text("Avg ImGui time: %.3f ms/%.1f FPS",
               1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+  if (netplay) {
+    ImGui::Text("Netplay frame: %u, rollbacks: %u", netplay->frame(),
+                netplay->rollbacks());
+  }
+  ImGui::End();
+
+  Metrics::Snapshot snap = metrics.snapshot();
+  ImGui::Begin("Metrics");
+  ImGui::Text("Instructions: %.0f/s", snap.instructions_per_second);
+  ImGui::Text("Emulated: %.1f FPS, presented: %.1f FPS", snap.emulated_fps,
+              snap.presented_fps);
+  ImGui::Text("Texture uploads: %llu bytes",
+              (unsigned long long)snap.texture_bytes);
+  for (int i = 0; i < Metrics::LockCount; ++i) {
+    ImGui::Text("Waiting on %s: %.1f ms", Metrics::lock_name(Metrics::Lock(i)),
+                snap.lock_wait_ms[i]);
+  }
+  plotHistogram("Frame time", snap.frame_time);
+  plotHistogram("Input to present", snap.input_to_present);
+  if (ImGui::CollapsingHeader("Input latency")) {
+    plotHistogram("Event to photon", snap.latency.event_to_photon);
+    plotHistogram("Event to key read", snap.latency.event_to_read);
+    plotHistogram("Key read to photon", snap.latency.read_to_photon);
+    ImGui::Text("Never read: %llu, no visible effect: %llu",
+                (unsigned long long)snap.latency.unread,
+                (unsigned long long)snap.latency.invisible);
+  }
   ImGui::End();
 }
 
+// Shows the basic block being executed and the functions it belongs to.
+// Instructions are shown as loaded, from the analysis.
+void SdlInterface::codeFrame() {
+  if (!analysis)
+    return;
+  lock(emu_mtx, Metrics::EmuLock);
+  uint16_t pc = emulator.refI(Chip8::Internal::Chip8PC);
+  emu_mtx.unlock();
+  ImGui::Begin("Code");
+  std::string in;
+  for (uint16_t entry : analysis->functions_at(pc))
+    in += (in.empty() ? "" : ", ") + analysis->label(entry);
+  ImGui::Text("In: %s", in.empty() ? "(not reached by analysis)" : in.c_str());
+  ImGui::Separator();
+  if (const Analysis::Block *block = analysis->block_at(pc)) {
+    std::string name = analysis->label(block->start);
+    if (!name.empty())
+      ImGui::Text("%s:", name.c_str());
+    for (uint16_t address = block->start; address < block->end;
+         address += 2) {
+      ImGui::Text("%s %03X: %s", address == pc ? ">" : " ", address,
+                  disassemble(analysis->fetch(address)).c_str());
+    }
+  }
+  ImGui::End();
+}
+
+void SdlInterface::plotHistogram(const char *label,
+                                 const Histogram::Snapshot &hist) {
+  float values[Histogram::bucket_count];
+  for (int i = 0; i < Histogram::bucket_count; ++i)
+    values[i] = hist.buckets[i];
+  ImGui::Text("%s: p50 %.0f us, p99 %.0f us", label, hist.percentile(0.5),
+              hist.percentile(0.99));
+  ImGui::PlotHistogram(label, values, Histogram::bucket_count, 0, nullptr, 0,
+                       FLT_MAX, ImVec2(0, 40));
+}
+
 GLuint SdlInterface::load_shaders() {
   std::string vshader, fshader;
   const char *vshader_ptr, *fshader_ptr;
@@ -348,4 +593,5 @@ GLuint SdlInterface::load_shaders() {
   glDeleteShader(fshader_id);
 
   return program_id;
-}
\ No newline at end of file
+}
+#endif
@@ -1,38 +1,83 @@
+#include "Analysis.h"
 #include "Interface.h"
-#include <GL/glew.h>
 #include <SDL2/SDL.h>
+#ifndef NO_GL
+#include <GL/glew.h>
+#endif
+#include <memory>
 #include <mutex>
 
 #define INTERFACE SdlInterface
 
 class SdlInterface : public Interface {
 public:
-  SdlInterface(Chip8 &, int, char *args[]);
+  SdlInterface(Chip8 &, int, char *args[],
+               const DisplayOptions & = DisplayOptions());
   bool update();
   void update_screen();
   bool error_occurred() const;
   std::string error_message() const;
+  // The analysis of the loaded ROM shown by the debugger, which must
+  // outlive the interface. The code window is left out without one.
+  void set_analysis(const Analysis *);
 
 private:
   SDL_Window *window;
+#ifndef NO_GL
   SDL_GLContext ctx;
   GLuint program_id;
+#endif
 
   std::string err;
   bool error;
+#ifndef NO_GL
   GLuint buffer;
   GLuint texture;
   GLubyte screenTex[32][64][3];
+#endif
   bool debug;
   float scale;
   Uint32 render_time;
   Uint32 tick_time;
   std::mutex emu_mtx, sdl_mtx;
   bool closing;
+  // Scratch machine the run-ahead frames are emulated on, so the live
+  // emulator never has to be rolled back.
+  Chip8 ahead;
+  // Live state ahead was last started from, valid once ahead_ready.
+  Chip8 ahead_start;
+  bool ahead_ready;
+  const Analysis *analysis;
+  // Display contents being presented.
+  uint64_t frame[32];
+
+  // Software rendering, used when asked for or when OpenGL is unavailable.
+  bool software;
+  SoftRenderer soft;
+  SDL_Renderer *renderer;
+  SDL_Texture *frame_texture;
+  // Set when the renderer cannot wait for vertical sync, so presenting is
+  // paced to 60 Hz by sleeping instead.
+  bool pace;
+  Uint32 next_present;
 
   static int8_t translate_key(const SDL_Keycode);
+  void send_key(uint8_t key, bool pressed);
+  bool init_software();
+  void lock(std::mutex &, Metrics::Lock);
+  bool next_frame();
+  void present_software(bool changed);
+#ifndef NO_GL
+  // OpenGL rendering and the ImGui debugger, left out of builds without
+  // OpenGL (make NO_GL=1).
   void guiFrame();
+  void codeFrame();
+  void plotHistogram(const char *, const Histogram::Snapshot &);
 
+  bool init_gl();
   GLuint load_shaders();
   void gen_screentex();
+  void present_gl(bool changed);
+#endif
+  bool run_ahead();
 };
\ No newline at end of file
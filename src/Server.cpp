@@ -0,0 +1,278 @@
+#include "Server.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+static const int max_events = 256;
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+Server::Session::Session(const Chip8 &initial, int fd)
+    : emulator(initial), fd(fd), keys(0), closed(false), partial_event(-1),
+      frame(0), out_pos(0) {
+  memset(sent, 0, sizeof(sent));
+}
+
+Server::Server(const Options &opts, const uint8_t *rom, uint16_t rom_size)
+    : options(opts), initial(rom, rom_size), listen_fd(-1), epoll_fd(-1),
+      error(false), running(false), pool(opts.threads) {
+  std::stringstream ss;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (options.socket_path.size() >= sizeof(addr.sun_path)) {
+    error = true;
+    err = "Socket path is too long";
+    return;
+  }
+  strcpy(addr.sun_path, options.socket_path.c_str());
+  unlink(addr.sun_path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+          0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    error = true;
+    ss << "Cannot listen on " << options.socket_path << ": "
+       << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  set_nonblocking(listen_fd);
+
+  epoll_fd = epoll_create1(0);
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr; // the listening socket
+  if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+    error = true;
+    ss << "epoll failed: " << strerror(errno);
+    err = ss.str();
+  }
+}
+
+Server::~Server() {
+  for (auto &session : sessions)
+    close(session->fd);
+  for (auto &session : pending)
+    close(session->fd);
+  if (epoll_fd >= 0)
+    close(epoll_fd);
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(options.socket_path.c_str());
+  }
+}
+
+bool Server::error_occurred() const { return error; }
+
+std::string Server::error_message() const { return err; }
+
+void Server::stop() { running = false; }
+
+void Server::run() {
+  running = true;
+  std::thread io_thread(&Server::io_loop, this);
+
+  auto interval =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / options.frame_rate));
+  auto next_tick = std::chrono::steady_clock::now();
+  while (running) {
+    tick();
+    next_tick += interval;
+    auto now = std::chrono::steady_clock::now();
+    if (next_tick < now)
+      next_tick = now; // overloaded, don't try to catch up
+    std::this_thread::sleep_until(next_tick);
+  }
+  io_thread.join();
+}
+
+void Server::io_loop() {
+  epoll_event events[max_events];
+  while (running) {
+    int count = epoll_wait(epoll_fd, events, max_events, 100);
+    for (int i = 0; i < count; ++i) {
+      Session *session = static_cast<Session *>(events[i].data.ptr);
+      if (!session)
+        accept_clients();
+      else
+        read_events(*session);
+    }
+  }
+}
+
+void Server::accept_clients() {
+  int fd;
+  while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+    set_nonblocking(fd);
+    std::unique_ptr<Session> session(new Session(initial, fd));
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = session.get();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      close(fd);
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(pending_mtx);
+    pending.push_back(std::move(session));
+  }
+}
+
+void Server::read_events(Session &session) {
+  uint8_t buf[256];
+  ssize_t len;
+  while ((len = read(session.fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < len; ++i) {
+      if (session.partial_event < 0) {
+        session.partial_event = buf[i];
+        continue;
+      }
+      uint8_t key = buf[i] & 0xF;
+      if (session.partial_event == 'D')
+        session.keys.fetch_or(1 << key);
+      else if (session.partial_event == 'U')
+        session.keys.fetch_and(~(1 << key));
+      session.partial_event = -1;
+    }
+  }
+  if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    // The scheduler frees the session once it sees it closed, so it must
+    // not be touched after this.
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session.fd, nullptr);
+    session.closed = true;
+  }
+}
+
+void Server::tick() {
+  {
+    std::lock_guard<std::mutex> lock(pending_mtx);
+    for (auto &session : pending)
+      sessions.push_back(std::move(session));
+    pending.clear();
+  }
+  for (size_t i = 0; i < sessions.size();) {
+    if (sessions[i]->closed) {
+      close(sessions[i]->fd);
+      sessions[i] = std::move(sessions.back());
+      sessions.pop_back();
+    } else {
+      ++i;
+    }
+  }
+
+  unsigned cycles = options.frame_cycles;
+  pool.parallel_for(sessions.size(),
+                    [&](size_t i) { run_frame(*sessions[i], cycles); });
+}
+
+void Server::run_frame(Session &session, unsigned cycles) {
+  session.emulator.set_keys(session.keys.load(std::memory_order_relaxed));
+  for (unsigned i = 0; i < cycles; ++i)
+    session.emulator.cycle();
+  ++session.frame;
+
+  // A client that does not keep up gets fewer, larger deltas instead of a
+  // growing backlog.
+  if (session.out_pos < session.out.size())
+    flush(session);
+  if (session.out_pos == session.out.size()) {
+    encode_frame(session);
+    flush(session);
+  }
+}
+
+void Server::encode_frame(Session &session) {
+  auto &screen = session.emulator.get_display();
+  uint32_t changed = 0;
+  uint8_t rows[32 * 8];
+  size_t size = 0;
+  for (int y = 0; y < 32; ++y) {
+    uint64_t diff = screen[y] ^ session.sent[y];
+    if (!diff)
+      continue;
+    changed |= uint32_t(1) << y;
+    for (int b = 7; b >= 0; --b)
+      rows[size++] = diff >> (8 * b);
+    session.sent[y] = screen[y];
+  }
+
+  session.out.clear();
+  session.out_pos = 0;
+  if (!changed)
+    return;
+
+  std::vector<uint8_t> &out = session.out;
+  out.push_back('F');
+  for (int i = 0; i < 4; ++i)
+    out.push_back(session.frame >> (8 * i));
+  for (int i = 0; i < 4; ++i)
+    out.push_back(changed >> (8 * i));
+  out.resize(out.size() + 2);
+  size_t header = out.size();
+  packbits(rows, size, out);
+  size_t payload = out.size() - header;
+  out[header - 2] = payload;
+  out[header - 1] = payload >> 8;
+}
+
+void Server::flush(Session &session) {
+  while (session.out_pos < session.out.size()) {
+    ssize_t len = send(session.fd, session.out.data() + session.out_pos,
+                       session.out.size() - session.out_pos,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (len > 0) {
+      session.out_pos += len;
+    } else {
+      // Let the IO thread notice a broken connection and retire it.
+      if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        shutdown(session.fd, SHUT_RDWR);
+      return;
+    }
+  }
+}
+
+// Build-time regression tests: payloads survive a round trip and runs are
+// compressed.
+namespace {
+constexpr bool round_trip(const std::vector<uint8_t> &data, size_t packed) {
+  std::vector<uint8_t> encoded, decoded;
+  Server::packbits(data.data(), data.size(), encoded);
+  return Server::unpackbits(encoded.data(), encoded.size(), decoded) &&
+         decoded == data && encoded.size() == packed;
+}
+
+static_assert(round_trip({}, 0));
+static_assert(round_trip({0x42}, 2));
+static_assert(round_trip({1, 2, 3, 3, 3, 4}, 7));
+// Runs longer than 128 bytes are split.
+static_assert(round_trip(std::vector<uint8_t>(256, 0), 4));
+static_assert(round_trip(std::vector<uint8_t>(129, 0xF0), 4));
+// Literals longer than 128 bytes are split.
+static_assert([] {
+  std::vector<uint8_t> data;
+  for (unsigned i = 0; i < 200; ++i)
+    data.push_back(i);
+  return round_trip(data, 202);
+}());
+// A changed row: literals and runs mixed.
+static_assert(round_trip({0, 0, 0, 0x3C, 0x42, 0x42, 0x3C, 0}, 9));
+
+constexpr bool truncated() {
+  std::vector<uint8_t> decoded;
+  const uint8_t literal[] = {3, 1, 2}, run[] = {0xFE};
+  return !Server::unpackbits(literal, sizeof(literal), decoded) &&
+         !Server::unpackbits(run, sizeof(run), decoded);
+}
+static_assert(truncated());
+} // namespace
@@ -0,0 +1,139 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+#include "ThreadPool.h"
+
+// Hosts many emulator sessions of one ROM for remote clients attached over
+// a Unix domain stream socket. Each connection gets its own machine; all
+// machines are advanced one frame per tick on a thread pool.
+//
+// Client to server, two bytes per event:
+//   'D' key   key pressed
+//   'U' key   key released
+// Server to client, whenever the screen changed since the last frame sent:
+//   'F', u32 frame, u32 changed row mask, u16 payload length, payload
+// Integers are little endian. The payload is the PackBits compressed XOR of
+// each changed row with its previously sent contents, 8 bytes per row, rows
+// in ascending order, leftmost pixel in the most significant bit. Clients
+// start from a blank screen.
+class Server {
+public:
+  struct Options {
+    std::string socket_path;
+    unsigned frame_cycles = 10;
+    double frame_rate = 60;
+    unsigned threads = 0; // one per hardware thread
+  };
+
+  Server(const Options &, const uint8_t *rom, uint16_t rom_size);
+  ~Server();
+
+  bool error_occurred() const;
+  std::string error_message() const;
+
+  // Serves clients until stop() is called.
+  void run();
+  // Only clears a flag, so it may be called from a signal handler.
+  void stop();
+
+  // Payload encoding: appends the PackBits compression of the bytes.
+  static constexpr void packbits(const uint8_t *, size_t,
+                                 std::vector<uint8_t> &);
+  // Appends the decoded bytes, false if the input is truncated.
+  static constexpr bool unpackbits(const uint8_t *, size_t,
+                                   std::vector<uint8_t> &);
+
+private:
+  struct Session {
+    Session(const Chip8 &, int);
+
+    // Shares the memory of initial until it writes to it.
+    SharedChip8 emulator;
+    int fd;
+    std::atomic<uint16_t> keys;
+    // Set by the IO thread once the socket is no longer polled.
+    std::atomic<bool> closed;
+    // Only touched by the IO thread: first byte of a split event.
+    int partial_event;
+    // Only touched by the worker running the session.
+    uint64_t sent[32];
+    uint32_t frame;
+    std::vector<uint8_t> out;
+    size_t out_pos;
+  };
+
+  Options options;
+  Chip8 initial; // outlives the sessions, whose memory image it is
+  int listen_fd;
+  int epoll_fd;
+  bool error;
+  std::string err;
+  std::atomic<bool> running;
+
+  ThreadPool pool;
+  std::vector<std::unique_ptr<Session>> sessions;
+  std::mutex pending_mtx;
+  std::vector<std::unique_ptr<Session>> pending;
+
+  void io_loop();
+  void accept_clients();
+  void read_events(Session &);
+  void tick();
+  static void run_frame(Session &, unsigned cycles);
+  static void encode_frame(Session &);
+  static void flush(Session &);
+};
+
+constexpr void Server::packbits(const uint8_t *data, size_t size,
+                                std::vector<uint8_t> &out) {
+  size_t i = 0;
+  while (i < size) {
+    size_t run = 1;
+    while (i + run < size && run < 128 && data[i + run] == data[i])
+      ++run;
+    if (run >= 2) {
+      out.push_back(uint8_t(257 - run));
+      out.push_back(data[i]);
+      i += run;
+      continue;
+    }
+    // Literal run up to the next pair of equal bytes.
+    size_t lit = 1;
+    while (i + lit < size && lit < 128 &&
+           !(i + lit + 1 < size && data[i + lit] == data[i + lit + 1]))
+      ++lit;
+    out.push_back(uint8_t(lit - 1));
+    out.insert(out.end(), data + i, data + i + lit);
+    i += lit;
+  }
+}
+
+constexpr bool Server::unpackbits(const uint8_t *data, size_t size,
+                                  std::vector<uint8_t> &out) {
+  size_t i = 0;
+  while (i < size) {
+    uint8_t header = data[i++];
+    if (header < 128) {
+      size_t lit = header + 1;
+      if (i + lit > size)
+        return false;
+      out.insert(out.end(), data + i, data + i + lit);
+      i += lit;
+    } else if (header > 128) {
+      if (i == size)
+        return false;
+      out.insert(out.end(), 257 - header, data[i++]);
+    }
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include "SharedFrame.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct SharedFrame::Segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;
+  uint32_t size;
+  Frame frame;
+};
+
+static_assert(sizeof(SharedFrame::Frame) % 8 == 0,
+              "frames are copied in 64-bit words");
+static_assert(std::atomic_ref<uint64_t>::is_always_lock_free &&
+                  std::atomic_ref<uint32_t>::is_always_lock_free,
+              "atomics in shared memory must not need locks");
+
+// Frames are copied word by word with relaxed atomics, which is what makes
+// a read racing with a write well defined; the sequence tells whether the
+// result can be used.
+static const size_t frame_words = sizeof(SharedFrame::Frame) / 8;
+// Attempts before a reader gives up on a frame.
+static const int read_attempts = 64;
+
+static std::atomic_ref<uint32_t> atomic(uint32_t &word) {
+  return std::atomic_ref<uint32_t>(word);
+}
+
+SharedFrame::SharedFrame(const std::string &segment_name)
+    : name(segment_name), segment(nullptr), frames(0) {
+  std::stringstream ss;
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(Segment)) != 0) {
+    ss << "Cannot create shared memory " << name << ": " << strerror(errno);
+    err = ss.str();
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  void *mem =
+      mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    ss << "Cannot map shared memory " << name << ": " << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  segment = static_cast<Segment *>(mem);
+  segment->version = version;
+  segment->size = sizeof(Frame);
+  // A writer of an earlier run may have died halfway through a frame.
+  if (atomic(segment->sequence).load(std::memory_order_relaxed) & 1)
+    atomic(segment->sequence).fetch_add(1, std::memory_order_release);
+  atomic(segment->magic).store(magic, std::memory_order_release);
+}
+
+SharedFrame::~SharedFrame() {
+  if (!segment)
+    return;
+  munmap(segment, sizeof(Segment));
+  shm_unlink(name.c_str());
+}
+
+bool SharedFrame::error_occurred() const { return !segment; }
+
+std::string SharedFrame::error_message() const { return err; }
+
+void SharedFrame::publish(const Chip8 &emu, uint64_t cycles) {
+  if (!segment)
+    return;
+  Frame frame = {};
+  frame.frame = ++frames;
+  frame.cycles = cycles;
+  memcpy(frame.screen, emu.get_display(), sizeof(frame.screen));
+  frame.pc = emu.refI(Chip8::Chip8PC);
+  frame.I = emu.refI(Chip8::Chip8I);
+  frame.keys = emu.get_keys();
+  frame.delay_timer = emu.get_delay_timer();
+  for (int i = 0; i < 16; ++i)
+    frame.v[i] = emu.V(i);
+  frame.sp = emu.get_sp();
+
+  auto sequence = atomic(segment->sequence);
+  uint32_t seq = sequence.load(std::memory_order_relaxed);
+  sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  uint64_t *src = reinterpret_cast<uint64_t *>(&frame),
+           *dst = reinterpret_cast<uint64_t *>(&segment->frame);
+  for (size_t i = 0; i < frame_words; ++i)
+    std::atomic_ref<uint64_t>(dst[i]).store(src[i],
+                                            std::memory_order_relaxed);
+  sequence.store(seq + 2, std::memory_order_release);
+}
+
+SharedFrame::Reader::Reader(const std::string &name) : segment(nullptr) {
+  std::stringstream ss;
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    ss << "Cannot open shared memory " << name << ": " << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  void *mem = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    ss << "Cannot map shared memory " << name << ": " << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  segment = static_cast<Segment *>(mem);
+  if (atomic(segment->magic).load(std::memory_order_acquire) != magic ||
+      segment->version != version || segment->size != sizeof(Frame)) {
+    err = "Not a frame segment of this version: " + name;
+    munmap(segment, sizeof(Segment));
+    segment = nullptr;
+  }
+}
+
+SharedFrame::Reader::~Reader() {
+  if (segment)
+    munmap(segment, sizeof(Segment));
+}
+
+bool SharedFrame::Reader::error_occurred() const { return !segment; }
+
+std::string SharedFrame::Reader::error_message() const { return err; }
+
+uint32_t SharedFrame::Reader::sequence() const {
+  return atomic(segment->sequence).load(std::memory_order_acquire);
+}
+
+bool SharedFrame::Reader::read(Frame &frame) const {
+  auto sequence = atomic(segment->sequence);
+  uint64_t *dst = reinterpret_cast<uint64_t *>(&frame),
+           *src = reinterpret_cast<uint64_t *>(&segment->frame);
+  for (int attempt = 0; attempt < read_attempts; ++attempt) {
+    uint32_t before = sequence.load(std::memory_order_acquire);
+    if (before & 1)
+      continue;
+    for (size_t i = 0; i < frame_words; ++i)
+      dst[i] =
+          std::atomic_ref<uint64_t>(src[i]).load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence.load(std::memory_order_relaxed) == before)
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,82 @@
+#ifndef SHAREDFRAME_H
+#define SHAREDFRAME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Chip8.h"
+
+// Publishes the display and registers into a POSIX shared memory segment
+// for other processes, guarded by a seqlock: the emulator never waits for
+// readers, and readers never block it.
+//
+// Segment layout, native endianness:
+//   0   u32 magic 0x42463843 ("C8FB")
+//   4   u32 version (1)
+//   8   u32 sequence, odd while a frame is being written
+//   12  u32 size of the Frame that follows
+//   16  Frame
+// To sample a frame, read an even sequence, then the frame (in place or by
+// copying), then the sequence again; the frame is consistent if both reads
+// are equal. Reader below does exactly that.
+class SharedFrame {
+  struct Segment;
+
+public:
+  static constexpr uint32_t magic = 0x42463843;
+  static constexpr uint32_t version = 1;
+
+  struct Frame {
+    uint64_t frame;      // frames published so far
+    uint64_t cycles;     // emulated cycles
+    uint64_t screen[32]; // rows, leftmost pixel in the most significant bit
+    uint16_t pc;
+    uint16_t I;
+    uint16_t keys;        // bitmask of pressed keys
+    uint16_t delay_timer;
+    uint8_t v[16];
+    uint8_t sp;
+    uint8_t padding[7];
+  };
+
+  // Creates (or takes over) the segment, e.g. "/chip8".
+  explicit SharedFrame(const std::string &name);
+  ~SharedFrame();
+  SharedFrame(const SharedFrame &) = delete;
+  SharedFrame &operator=(const SharedFrame &) = delete;
+
+  bool error_occurred() const;
+  std::string error_message() const;
+
+  // Wait-free; called by the emulation thread once per frame.
+  void publish(const Chip8 &, uint64_t cycles);
+
+  class Reader {
+  public:
+    explicit Reader(const std::string &name);
+    ~Reader();
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    bool error_occurred() const;
+    std::string error_message() const;
+    // Changes whenever a new frame is published.
+    uint32_t sequence() const;
+    // Copies out a consistent frame; false if the writer kept getting in
+    // the way.
+    bool read(Frame &) const;
+
+  private:
+    Segment *segment; // mapped read-only
+    std::string err;
+  };
+
+private:
+  std::string name;
+  Segment *segment;
+  uint64_t frames;
+  std::string err;
+};
+
+#endif
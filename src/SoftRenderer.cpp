@@ -0,0 +1,252 @@
+#include "SoftRenderer.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOFTRENDERER_X86
+#endif
+
+// Phosphor intensity left after a frame: level - level / 4 - 1.
+static const unsigned persistence_shift = 2;
+
+// Expands one display row into 64 bytes, 0xFF for lit pixels, 0 otherwise.
+static void expand_row_scalar(uint64_t row, uint8_t *out) {
+  for (int x = 0; x < 64; ++x, row <<= 1)
+    out[x] = row >> 63 ? 0xFF : 0;
+}
+
+// Writes count pixels, each replicated repeat times, looked up in palette.
+static void emit_row_scalar(const uint8_t *src, unsigned count,
+                            unsigned repeat, const uint32_t *palette,
+                            uint32_t *dst) {
+  for (unsigned i = 0; i < count; ++i) {
+    uint32_t color = palette[src[i]];
+    for (unsigned j = 0; j < repeat; ++j)
+      *dst++ = color;
+  }
+}
+
+#ifdef SOFTRENDERER_X86
+// Multiplied by a byte, repeats it in all eight bytes.
+static const uint64_t broadcast = 0x0101010101010101;
+
+// Each byte of the row is broadcast to eight lanes and tested against the
+// lane's bit, leftmost pixel first.
+static void expand_row_sse2(uint64_t row, uint8_t *out) {
+  const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, char(128), 1, 2,
+                                    4, 8, 16, 32, 64, char(128));
+  for (int i = 0; i < 4; ++i) {
+    uint64_t first = row >> (56 - 16 * i) & 0xFF,
+             second = row >> (48 - 16 * i) & 0xFF;
+    __m128i bytes = _mm_set_epi64x(second * broadcast, first * broadcast);
+    __m128i lit = _mm_cmpeq_epi8(_mm_and_si128(bytes, bits), bits);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * i), lit);
+  }
+}
+
+static void emit_row_sse2(const uint8_t *src, unsigned count, unsigned repeat,
+                          const uint32_t *palette, uint32_t *dst) {
+  if (repeat < 4) {
+    emit_row_scalar(src, count, repeat, palette, dst);
+    return;
+  }
+  // The last store of a pixel may overlap the previous one, but never the
+  // next pixel.
+  for (unsigned i = 0; i < count; ++i, dst += repeat) {
+    __m128i color = _mm_set1_epi32(palette[src[i]]);
+    for (unsigned j = 0; j + 4 <= repeat; j += 4)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j), color);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + repeat - 4), color);
+  }
+}
+
+__attribute__((target("avx2"))) static void expand_row_avx2(uint64_t row,
+                                                            uint8_t *out) {
+  const __m256i bits = _mm256_set1_epi64x(0x0102040810204080ll);
+  for (int i = 0; i < 2; ++i) {
+    uint64_t part = row >> (32 - 32 * i);
+    __m256i bytes = _mm256_set_epi64x(
+        (part & 0xFF) * broadcast, (part >> 8 & 0xFF) * broadcast,
+        (part >> 16 & 0xFF) * broadcast, (part >> 24 & 0xFF) * broadcast);
+    __m256i lit = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bits), bits);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 32 * i), lit);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+emit_row_avx2(const uint8_t *src, unsigned count, unsigned repeat,
+              const uint32_t *palette, uint32_t *dst) {
+  if (repeat < 8) {
+    emit_row_sse2(src, count, repeat, palette, dst);
+    return;
+  }
+  for (unsigned i = 0; i < count; ++i, dst += repeat) {
+    __m256i color = _mm256_set1_epi32(palette[src[i]]);
+    for (unsigned j = 0; j + 8 <= repeat; j += 8)
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + j), color);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + repeat - 8),
+                        color);
+  }
+}
+#endif
+
+SoftRenderer::SoftRenderer(const Options &opts) : options(opts) {
+  factor = options.filter == Scale3x ? 3 : options.filter == Scale2x ? 2 : 1;
+  repeat = std::max(1u, options.scale / factor);
+  memset(level, 0, sizeof(level));
+
+  for (unsigned i = 0; i < 256; ++i) {
+    uint32_t color = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      unsigned bg = options.background >> shift & 0xFF,
+               fg = options.foreground >> shift & 0xFF;
+      color |= (bg + (int(fg) - int(bg)) * int(i) / 255) << shift;
+    }
+    palette[i] = color;
+  }
+
+  expand_row = expand_row_scalar;
+  emit_row = emit_row_scalar;
+#ifdef SOFTRENDERER_X86
+  expand_row = expand_row_sse2;
+  emit_row = emit_row_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    expand_row = expand_row_avx2;
+    emit_row = emit_row_avx2;
+  }
+#endif
+}
+
+unsigned SoftRenderer::width() const { return 64 * factor * repeat; }
+
+unsigned SoftRenderer::height() const { return 32 * factor * repeat; }
+
+bool SoftRenderer::fading() const { return options.phosphor; }
+
+bool SoftRenderer::parse_filter(const char *name, Filter &filter) {
+  static const struct {
+    const char *name;
+    Filter filter;
+  } filters[] = {{"nearest", Nearest}, {"scale2x", Scale2x},
+                 {"scale3x", Scale3x}};
+  for (auto &f : filters) {
+    if (!strcmp(name, f.name)) {
+      filter = f.filter;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SoftRenderer::render(const uint64_t (&screen)[32], uint32_t *pixels,
+                          size_t pitch) {
+  if (options.phosphor) {
+    alignas(32) uint8_t lit[32][64];
+    for (int y = 0; y < 32; ++y)
+      expand_row(screen[y], lit[y]);
+    persist(lit);
+  } else {
+    for (int y = 0; y < 32; ++y)
+      expand_row(screen[y], level[y]);
+  }
+
+  const uint8_t *src = &level[0][0];
+  if (factor == 2) {
+    scale2x();
+    src = filtered;
+  } else if (factor == 3) {
+    scale3x();
+    src = filtered;
+  }
+
+  unsigned src_width = 64 * factor, src_height = 32 * factor;
+  size_t row_bytes = src_width * repeat * sizeof(uint32_t);
+  uint8_t *out = reinterpret_cast<uint8_t *>(pixels);
+  for (unsigned y = 0; y < src_height; ++y, src += src_width) {
+    uint32_t *first = reinterpret_cast<uint32_t *>(out);
+    emit_row(src, src_width, repeat, palette, first);
+    out += pitch;
+    for (unsigned r = 1; r < repeat; ++r, out += pitch)
+      memcpy(out, first, row_bytes);
+  }
+}
+
+void SoftRenderer::persist(const uint8_t (&lit)[32][64]) {
+  uint8_t *lvl = &level[0][0];
+  const uint8_t *on = &lit[0][0];
+  size_t i = 0;
+#ifdef SOFTRENDERER_X86
+  const __m128i low_bits = _mm_set1_epi8(0xFF >> persistence_shift),
+                one = _mm_set1_epi8(1);
+  for (; i < sizeof(level); i += 16) {
+    __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(lvl + i));
+    __m128i d =
+        _mm_and_si128(_mm_srli_epi16(v, persistence_shift), low_bits);
+    v = _mm_subs_epu8(_mm_subs_epu8(v, d), one);
+    v = _mm_max_epu8(v, _mm_load_si128(
+                            reinterpret_cast<const __m128i *>(on + i)));
+    _mm_store_si128(reinterpret_cast<__m128i *>(lvl + i), v);
+  }
+#endif
+  for (; i < sizeof(level); ++i) {
+    int v = lvl[i] - (lvl[i] >> persistence_shift) - 1;
+    lvl[i] = std::max<int>(std::max(v, 0), on[i]);
+  }
+}
+
+// AdvMAME2x/3x: each pixel E with neighbours
+//   A B C
+//   D E F
+//   G H I
+// is split into 2x2 or 3x3 pixels that take the colour of a neighbour where
+// two neighbours form an edge through the corner. Pixels past the border
+// repeat the edge.
+void SoftRenderer::scale2x() {
+  for (int y = 0; y < 32; ++y) {
+    const uint8_t *up = level[std::max(y - 1, 0)], *row = level[y],
+                  *down = level[std::min(y + 1, 31)];
+    uint8_t *out0 = filtered + (2 * y) * 128, *out1 = out0 + 128;
+    for (int x = 0; x < 64; ++x) {
+      int l = std::max(x - 1, 0), r = std::min(x + 1, 63);
+      uint8_t B = up[x], D = row[l], E = row[x], F = row[r], H = down[x];
+      if (B != H && D != F) {
+        out0[2 * x] = D == B ? D : E;
+        out0[2 * x + 1] = B == F ? F : E;
+        out1[2 * x] = D == H ? D : E;
+        out1[2 * x + 1] = H == F ? F : E;
+      } else {
+        out0[2 * x] = out0[2 * x + 1] = out1[2 * x] = out1[2 * x + 1] = E;
+      }
+    }
+  }
+}
+
+void SoftRenderer::scale3x() {
+  for (int y = 0; y < 32; ++y) {
+    const uint8_t *up = level[std::max(y - 1, 0)], *row = level[y],
+                  *down = level[std::min(y + 1, 31)];
+    uint8_t *out0 = filtered + (3 * y) * 192, *out1 = out0 + 192,
+            *out2 = out1 + 192;
+    for (int x = 0; x < 64; ++x) {
+      int l = std::max(x - 1, 0), r = std::min(x + 1, 63);
+      uint8_t A = up[l], B = up[x], C = up[r], D = row[l], E = row[x],
+              F = row[r], G = down[l], H = down[x], I = down[r];
+      uint8_t *o0 = out0 + 3 * x, *o1 = out1 + 3 * x, *o2 = out2 + 3 * x;
+      if (B != H && D != F) {
+        o0[0] = D == B ? D : E;
+        o0[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+        o0[2] = B == F ? F : E;
+        o1[0] = (D == B && E != G) || (D == H && E != A) ? D : E;
+        o1[1] = E;
+        o1[2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+        o2[0] = D == H ? D : E;
+        o2[1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+        o2[2] = H == F ? F : E;
+      } else {
+        o0[0] = o0[1] = o0[2] = o1[0] = o1[1] = o1[2] = o2[0] = o2[1] =
+            o2[2] = E;
+      }
+    }
+  }
+}
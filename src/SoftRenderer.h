@@ -0,0 +1,61 @@
+#ifndef SOFTRENDERER_H
+#define SOFTRENDERER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Draws the 64x32 display into an ARGB8888 pixel buffer on the CPU, for
+// hosts without OpenGL. The bitmap is expanded to one intensity byte per
+// pixel, optionally blended with the previous frames (phosphor persistence,
+// which hides the flicker of sprites that are erased and redrawn), run
+// through a pixel-art filter and finally scaled up by pixel replication.
+// Row expansion and output use SSE2, or AVX2 when the CPU has it.
+class SoftRenderer {
+public:
+  enum Filter { Nearest, Scale2x, Scale3x };
+
+  struct Options {
+    unsigned scale = 10; // output pixels per CHIP-8 pixel
+    Filter filter = Nearest;
+    bool phosphor = false;
+    uint32_t foreground = 0xFFFFFFFF;
+    uint32_t background = 0xFF000000;
+  };
+
+  explicit SoftRenderer(const Options &);
+
+  // Size of the output in pixels. Scale2x and Scale3x output sizes are
+  // multiples of 128x64 and 192x96, so scales that are not a multiple of
+  // the filter's factor are rounded down (but never below it).
+  unsigned width() const;
+  unsigned height() const;
+
+  // Whether frames keep changing while the display is still, so render()
+  // has to be called for every presented frame.
+  bool fading() const;
+
+  // Writes height() rows of width() pixels, pitch bytes apart.
+  void render(const uint64_t (&screen)[32], uint32_t *pixels, size_t pitch);
+
+  static bool parse_filter(const char *, Filter &);
+
+private:
+  Options options;
+  unsigned factor; // of the filter
+  unsigned repeat; // pixel replication after the filter
+  uint32_t palette[256];
+  // Intensity of each display pixel, kept between frames for the phosphor
+  // blend.
+  alignas(32) uint8_t level[32][64];
+  alignas(32) uint8_t filtered[96 * 192];
+
+  void (*expand_row)(uint64_t, uint8_t *);
+  void (*emit_row)(const uint8_t *, unsigned, unsigned, const uint32_t *,
+                   uint32_t *);
+
+  void persist(const uint8_t (&lit)[32][64]);
+  void scale2x();
+  void scale3x();
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+// Indices handed out per lock acquisition.
+static const size_t chunk_size = 16;
+
+ThreadPool::ThreadPool(unsigned threads)
+    : job(nullptr), job_count(0), next_index(0), busy(0), generation(0),
+      stopping(false) {
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  // The calling thread takes part in every job as well.
+  for (unsigned i = 1; i < threads; ++i)
+    workers.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for (auto &th : workers)
+    th.join();
+}
+
+unsigned ThreadPool::size() const { return workers.size() + 1; }
+
+void ThreadPool::parallel_for(size_t count,
+                              const std::function<void(size_t)> &fn) {
+  std::unique_lock<std::mutex> lock(mtx);
+  job = &fn;
+  job_count = count;
+  next_index = 0;
+  ++generation;
+  start_cv.notify_all();
+  run_job(lock);
+  done_cv.wait(lock, [this] { return busy == 0; });
+  job = nullptr;
+}
+
+void ThreadPool::run_job(std::unique_lock<std::mutex> &lock) {
+  ++busy;
+  while (next_index < job_count) {
+    size_t begin = next_index;
+    size_t end = std::min(job_count, begin + chunk_size);
+    next_index = end;
+    lock.unlock();
+    for (size_t i = begin; i < end; ++i)
+      (*job)(i);
+    lock.lock();
+  }
+  if (--busy == 0)
+    done_cv.notify_all();
+}
+
+void ThreadPool::worker() {
+  std::unique_lock<std::mutex> lock(mtx);
+  unsigned seen = generation;
+  while (true) {
+    start_cv.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping)
+      return;
+    seen = generation;
+    if (job)
+      run_job(lock);
+  }
+}
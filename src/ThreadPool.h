@@ -0,0 +1,38 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run one index range at a time.
+class ThreadPool {
+public:
+  // 0 threads means one per hardware thread.
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  unsigned size() const;
+  // Calls fn(i) for every i in [0, count) on the workers and the calling
+  // thread, and returns once all calls have finished.
+  void parallel_for(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+  std::vector<std::thread> workers;
+  std::mutex mtx;
+  std::condition_variable start_cv, done_cv;
+  const std::function<void(size_t)> *job;
+  size_t job_count;
+  size_t next_index;
+  unsigned busy;
+  unsigned generation;
+  bool stopping;
+
+  void worker();
+  void run_job(std::unique_lock<std::mutex> &);
+};
+
+#endif
@@ -0,0 +1,606 @@
+#include "Trace.h"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const uint32_t file_magic = 0x52543843;  // "C8TR"
+static const uint32_t chunk_magic = 0x43543843; // "C8TC"
+static const uint32_t version = 2;
+static const size_t file_header_size = 12;
+// magic, stream, cycle, records, payload size
+static const size_t chunk_header_size = 24;
+static const size_t chunk_size = 128 * 1024;
+// flags, gap, jump, wait key, keys, opcode, registers, I, memory
+static const size_t max_record_size = 1 + 10 + 5 + 1 + 2 + 2 + 18 + 5 + 20;
+// Chunks waiting for the disk before recorders have to wait too.
+static const size_t max_queued = 64;
+
+static void put32(uint8_t *out, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    out[i] = value >> 8 * i;
+}
+
+static void put64(uint8_t *out, uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    out[i] = value >> 8 * i;
+}
+
+static uint32_t get32(const uint8_t *in) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= uint32_t(in[i]) << 8 * i;
+  return value;
+}
+
+static uint64_t get64(const uint8_t *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i)
+    value |= uint64_t(in[i]) << 8 * i;
+  return value;
+}
+
+static constexpr uint8_t *put_varint(uint8_t *out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = value | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+static constexpr uint64_t zigzag(int32_t value) {
+  return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+static constexpr int32_t unzigzag(uint64_t value) {
+  return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+// Reads a varint, false if it runs past end.
+static constexpr bool get_varint(const uint8_t *&in, const uint8_t *end,
+                                 uint64_t &value) {
+  value = 0;
+  for (int shift = 0; in < end && shift < 64; shift += 7) {
+    uint8_t byte = *in++;
+    value |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// One bit per register that differs.
+static constexpr uint16_t changed_mask(const uint8_t *now,
+                                       const uint8_t *before) {
+#ifdef __SSE2__
+  if (!std::is_constant_evaluated()) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(now)),
+            b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(before));
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+  }
+#endif
+  uint16_t mask = 0;
+  for (int i = 0; i < 16; ++i)
+    mask |= (now[i] != before[i]) << i;
+  return mask;
+}
+
+// Memory written by Fx33 and Fx55: bytes starting at I.
+static constexpr unsigned written_bytes(Instruction inst) {
+  if (inst.hnibble() != 0xF)
+    return 0;
+  if (inst.byte() == 0x33)
+    return 3;
+  if (inst.byte() == 0x55)
+    return inst.x() + 1;
+  return 0;
+}
+
+// What the first record of a chunk starting at the machine is relative to.
+static constexpr Trace::Context context_of(const Chip8 &emu, uint64_t cycle) {
+  Trace::Context c{cycle, emu.refI(Chip8::Chip8PC), emu.get_keys(),
+                   emu.refI(Chip8::Chip8I), {}};
+  for (int i = 0; i < 16; ++i)
+    c.v[i] = emu.V(i);
+  return c;
+}
+
+// Runs the given cycle of the machine and encodes its record at out,
+// relative to last, leaving out past it. Cycles spent waiting for a key
+// have no record. wait_register carries an Fx0A wait over to the record
+// after it.
+static constexpr Instruction record_cycle(Chip8 &emu, uint64_t cycle,
+                                          Trace::Context &last,
+                                          int8_t &wait_register,
+                                          uint8_t *&out) {
+  if (emu.waiting_for_input())
+    return emu.cycle();
+
+  uint16_t pc = emu.refI(Chip8::Chip8PC), old_i = emu.refI(Chip8::Chip8I),
+           now_keys = emu.get_keys();
+  int wait_key = wait_register < 0 ? -1 : emu.V(wait_register);
+  Instruction inst = emu.cycle();
+  wait_register = emu.waiting_for_input() ? inst.x() : -1;
+
+  // Bytes are written through a local pointer: stores through uint8_t *
+  // may alias anything, and would otherwise force out to be reloaded.
+  uint8_t *o = out, *flags = o++, f = 0;
+  if (cycle - last.cycle > 1) {
+    f |= Trace::CycleGap;
+    o = put_varint(o, cycle - last.cycle - 1);
+  }
+  if (pc != last.pc) {
+    f |= Trace::Jump;
+    o = put_varint(o, zigzag(int32_t(pc) - int32_t(last.pc)));
+  }
+  if (wait_key >= 0) {
+    f |= Trace::KeyWait;
+    *o++ = wait_key;
+  }
+  if (now_keys != last.keys) {
+    f |= Trace::Keys;
+    o[0] = now_keys;
+    o[1] = now_keys >> 8;
+    o += 2;
+    last.keys = now_keys;
+  }
+  o[0] = inst.inst() >> 8;
+  o[1] = inst.inst();
+  o += 2;
+
+  // Registers are compared with the previous record rather than with the
+  // state before this cycle, so that keys read by Fx0A outside of cycles
+  // show up too.
+  const uint8_t *regs = &emu.V(0);
+  if (uint16_t changed = changed_mask(regs, last.v)) {
+    f |= Trace::Registers;
+    o[0] = changed;
+    o[1] = changed >> 8;
+    o += 2;
+    for (; changed; changed &= changed - 1)
+      *o++ = regs[std::countr_zero(changed)];
+    std::copy_n(regs, 16, last.v);
+  }
+  uint16_t new_i = emu.refI(Chip8::Chip8I);
+  if (new_i != last.I) {
+    f |= Trace::Index;
+    o = put_varint(o, zigzag(int32_t(new_i) - int32_t(last.I)));
+    last.I = new_i;
+  }
+  if (unsigned count = written_bytes(inst)) {
+    f |= Trace::Memory;
+    o = put_varint(o, old_i);
+    *o++ = count;
+    for (unsigned i = 0; i < count; ++i)
+      *o++ = emu.peek((old_i + i) & 0xFFF);
+  }
+  *flags = f;
+
+  last.cycle = cycle;
+  last.pc = pc + 2;
+  out = o;
+  return inst;
+}
+
+// Decodes the record at in, relative to last. Returns the end of the
+// record, nullptr if it runs past end.
+static constexpr const uint8_t *decode_record(Trace::Record &record,
+                                              Trace::Context &last,
+                                              const uint8_t *in,
+                                              const uint8_t *end) {
+  uint64_t value;
+  uint8_t f = *in++;
+  record.cycle = last.cycle + 1;
+  if (f & Trace::CycleGap) {
+    if (!get_varint(in, end, value))
+      return nullptr;
+    record.cycle += value;
+  }
+  record.pc = last.pc;
+  if (f & Trace::Jump) {
+    if (!get_varint(in, end, value))
+      return nullptr;
+    record.pc = last.pc + unzigzag(value);
+  }
+  record.wait_key = -1;
+  if (f & Trace::KeyWait) {
+    if (in == end || *in > 0xF)
+      return nullptr;
+    record.wait_key = *in++;
+  }
+  if (f & Trace::Keys) {
+    if (end - in < 2)
+      return nullptr;
+    last.keys = in[0] | in[1] << 8;
+    in += 2;
+  }
+  record.keys = last.keys;
+  if (end - in < 2)
+    return nullptr;
+  record.opcode = in[0] << 8 | in[1];
+  in += 2;
+
+  record.changed_v = 0;
+  if (f & Trace::Registers) {
+    if (end - in < 2)
+      return nullptr;
+    record.changed_v = in[0] | in[1] << 8;
+    in += 2;
+    for (int i = 0; i < 16; ++i) {
+      if (!(record.changed_v >> i & 1))
+        continue;
+      if (in == end)
+        return nullptr;
+      last.v[i] = *in++;
+    }
+  }
+  std::copy_n(last.v, 16, record.v);
+  record.changed_i = f & Trace::Index;
+  if (f & Trace::Index) {
+    if (!get_varint(in, end, value))
+      return nullptr;
+    last.I += unzigzag(value);
+  }
+  record.I = last.I;
+  record.written = 0;
+  if (f & Trace::Memory) {
+    if (!get_varint(in, end, value) || in == end || *in > 16 ||
+        end - in < 1 + *in)
+      return nullptr;
+    record.address = value;
+    record.written = *in++;
+    std::copy_n(in, record.written, record.memory);
+    in += record.written;
+  }
+
+  last.cycle = record.cycle;
+  last.pc = record.pc + 2;
+  return in;
+}
+
+// Runs a machine that has run cycles cycles through the record. Returns
+// false if it was not at the recorded PC.
+static constexpr bool replay_record(Chip8 &machine, uint64_t &cycles,
+                                    const Trace::Record &record) {
+  // Cycles without a record were spent waiting for a key.
+  while (cycles + 1 < record.cycle) {
+    machine.cycle();
+    ++cycles;
+  }
+  if (record.wait_key >= 0)
+    machine.press_key(record.wait_key);
+  machine.set_keys(record.keys);
+  bool matched = machine.refI(Chip8::Chip8PC) == record.pc;
+  machine.cycle();
+  ++cycles;
+  return matched;
+}
+
+Trace::Trace(const std::string &path) : stopping(false) {
+  file = fopen(path.c_str(), "wb");
+  if (!file) {
+    std::stringstream ss;
+    ss << "Cannot open trace " << path << ": " << strerror(errno);
+    err = ss.str();
+    return;
+  }
+  uint8_t header[file_header_size];
+  put32(header, file_magic);
+  put32(header + 4, version);
+  put32(header + 8, sizeof(Chip8));
+  fwrite(header, 1, sizeof(header), file);
+  thread = std::thread(&Trace::write_loop, this);
+}
+
+Trace::~Trace() {
+  if (!file)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  queued_cv.notify_one();
+  thread.join();
+  fclose(file);
+}
+
+bool Trace::error_occurred() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return !err.empty();
+}
+
+std::string Trace::error_message() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return err;
+}
+
+std::vector<uint8_t> Trace::submit(std::vector<uint8_t> chunk) {
+  std::unique_lock<std::mutex> lock(mtx);
+  if (file) {
+    written_cv.wait(lock, [this] { return queue.size() < max_queued; });
+    queue.push_back(std::move(chunk));
+    queued_cv.notify_one();
+  }
+  std::vector<uint8_t> next;
+  if (!spare.empty()) {
+    next = std::move(spare.back());
+    spare.pop_back();
+  }
+  return next;
+}
+
+void Trace::write_loop() {
+  std::unique_lock<std::mutex> lock(mtx);
+  for (;;) {
+    queued_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty())
+      return;
+    std::vector<uint8_t> chunk = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    bool ok = fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+    lock.lock();
+    if (!ok && err.empty())
+      err = std::string("Cannot write trace: ") + strerror(errno);
+    spare.push_back(std::move(chunk));
+    written_cv.notify_all();
+  }
+}
+
+Trace::Recorder::Recorder(Trace &t, uint32_t stream_id)
+    : trace(t), stream(stream_id), out(nullptr),
+      limit(nullptr), records(0), cycles(0),
+      last_chunk_cycle(0), last{}, wait_register(-1) {}
+
+Trace::Recorder::~Recorder() { flush(); }
+
+void Trace::Recorder::begin_chunk(const Chip8 &emu) {
+  buffer.resize(chunk_size);
+  memcpy(buffer.data() + chunk_header_size, &emu, sizeof(Chip8));
+  out = buffer.data() + chunk_header_size + sizeof(Chip8);
+  limit = buffer.data() + buffer.size() - max_record_size;
+  records = 0;
+  last_chunk_cycle = cycles;
+  last = context_of(emu, cycles);
+}
+
+void Trace::Recorder::flush() {
+  if (!out)
+    return;
+  if (records) {
+    size_t payload = out - buffer.data() - chunk_header_size - sizeof(Chip8);
+    put32(buffer.data(), chunk_magic);
+    put32(buffer.data() + 4, stream);
+    put64(buffer.data() + 8, last_chunk_cycle);
+    put32(buffer.data() + 16, records);
+    put32(buffer.data() + 20, payload);
+    buffer.resize(out - buffer.data());
+    buffer = trace.submit(std::move(buffer));
+  }
+  out = limit = nullptr;
+}
+
+Instruction Trace::Recorder::cycle(Chip8 &emu) {
+  if (out >= limit) {
+    flush();
+    begin_chunk(emu);
+  }
+  ++cycles;
+  uint8_t *start = out;
+  Instruction inst = record_cycle(emu, cycles, last, wait_register, out);
+  records += out != start;
+  return inst;
+}
+
+Trace::Reader::Reader(const std::string &path) : data(nullptr), size(0) {
+  std::stringstream ss;
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    ss << "Cannot open trace " << path << ": " << strerror(errno);
+    err = ss.str();
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  size = st.st_size;
+  void *mem = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                   : MAP_FAILED;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    ss << "Cannot map trace " << path << ": " << strerror(errno);
+    err = ss.str();
+    size = 0;
+    return;
+  }
+  data = static_cast<const uint8_t *>(mem);
+  if (size < file_header_size || get32(data) != file_magic ||
+      get32(data + 4) != version || get32(data + 8) != sizeof(Chip8)) {
+    err = "Not a trace of this version: " + path;
+    return;
+  }
+
+  // Index the chunks. A chunk cut short by a crash ends the trace.
+  size_t offset = file_header_size;
+  while (offset + chunk_header_size + sizeof(Chip8) <= size) {
+    const uint8_t *header = data + offset;
+    if (get32(header) != chunk_magic)
+      break;
+    size_t end =
+        offset + chunk_header_size + sizeof(Chip8) + get32(header + 20);
+    if (end > size)
+      break;
+    chunks.push_back({get32(header + 4), get64(header + 8), offset});
+    offset = end;
+  }
+}
+
+Trace::Reader::~Reader() {
+  if (data)
+    munmap(const_cast<uint8_t *>(data), size);
+}
+
+bool Trace::Reader::error_occurred() const { return !err.empty(); }
+
+std::string Trace::Reader::error_message() const { return err; }
+
+std::vector<uint32_t> Trace::Reader::streams() const {
+  std::vector<uint32_t> ids;
+  for (auto &chunk : chunks) {
+    if (std::find(ids.begin(), ids.end(), chunk.stream) == ids.end())
+      ids.push_back(chunk.stream);
+  }
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+Trace::Reader::Cursor Trace::Reader::seek(uint32_t stream, uint64_t cycle,
+                                          bool replay) const {
+  Cursor cursor(*this, stream, replay);
+  // The last chunk starting before the cycle; chunks of a stream are
+  // written in order.
+  auto first = std::partition_point(
+      cursor.chunks.begin(), cursor.chunks.end(), [&](size_t offset) {
+        return get64(data + offset + 8) + 1 < cycle;
+      });
+  size_t index = first - cursor.chunks.begin();
+  cursor.load(cursor.at, index ? index - 1 : 0);
+  if (replay)
+    cursor.reset_machine();
+
+  Record record;
+  Cursor::Position next = cursor.at;
+  while (cursor.decode(record, next) && record.cycle < cycle) {
+    cursor.commit(next);
+    if (replay)
+      cursor.apply(record);
+  }
+  return cursor;
+}
+
+Trace::Reader::Cursor::Cursor(const Reader &r, uint32_t stream, bool replay)
+    : reader(&r), at{}, replay(replay), mismatch(false), replay_cycle(0),
+      machine(nullptr, 0) {
+  for (auto &c : r.chunks) {
+    if (c.stream == stream)
+      chunks.push_back(c.offset);
+  }
+}
+
+const uint8_t *Trace::Reader::Cursor::keyframe(size_t index) const {
+  return reader->data + chunks[index] + chunk_header_size;
+}
+
+bool Trace::Reader::Cursor::load(Position &p, size_t index) const {
+  p.chunk = index;
+  if (index >= chunks.size()) {
+    p.pos = p.end = nullptr;
+    return false;
+  }
+  const uint8_t *header = reader->data + chunks[index];
+  p.pos = header + chunk_header_size + sizeof(Chip8);
+  p.end = p.pos + get32(header + 20);
+  // The keyframe is the recorder's own copy of the machine, so it is a
+  // valid object representation.
+  Chip8 state(nullptr, 0);
+  memcpy(&state, keyframe(index), sizeof(Chip8));
+  p.last = context_of(state, get64(header + 8));
+  return true;
+}
+
+void Trace::Reader::Cursor::commit(const Position &p) {
+  bool new_chunk = p.chunk != at.chunk;
+  at = p;
+  if (replay && new_chunk)
+    reset_machine();
+}
+
+void Trace::Reader::Cursor::reset_machine() {
+  if (at.chunk >= chunks.size())
+    return;
+  memcpy(&machine, keyframe(at.chunk), sizeof(Chip8));
+  replay_cycle = get64(reader->data + chunks[at.chunk] + 8);
+}
+
+bool Trace::Reader::Cursor::decode(Record &record, Position &p) const {
+  while (p.pos == p.end) {
+    if (!load(p, p.chunk + 1))
+      return false;
+  }
+  const uint8_t *in = decode_record(record, p.last, p.pos, p.end);
+  if (!in)
+    return false;
+  p.pos = in;
+  return true;
+}
+
+void Trace::Reader::Cursor::apply(const Record &record) {
+  if (!replay_record(machine, replay_cycle, record))
+    mismatch = true;
+}
+
+bool Trace::Reader::Cursor::next(Record &record) {
+  Position next = at;
+  if (!decode(record, next))
+    return false;
+  commit(next);
+  if (replay)
+    apply(record);
+  return true;
+}
+
+const Chip8 &Trace::Reader::Cursor::state() const { return machine; }
+
+bool Trace::Reader::Cursor::diverged() const { return mismatch; }
+
+// Build-time round trip: a ROM waiting for a key, with the key pressed and
+// released between two cycles of the wait, is recorded and then replayed.
+namespace {
+constexpr bool replays_key_wait() {
+  // wait for key into V1; V2 = V1; add V3, 01; jump to the add
+  const std::array<uint8_t, 8> rom{0xF1, 0x0A, 0x82, 0x10,
+                                   0x73, 0x01, 0x12, 0x04};
+  Chip8 live(rom), replayed(rom);
+  uint8_t buffer[8 * max_record_size]{};
+  uint8_t *out = buffer;
+  Trace::Context last = context_of(live, 0);
+  int8_t wait_register = -1;
+  for (uint64_t cycle = 1; cycle <= 8; ++cycle) {
+    if (cycle == 4) {
+      live.press_key(5);
+      live.release_key(5);
+    }
+    if (cycle == 6)
+      live.press_key(0xC);
+    record_cycle(live, cycle, last, wait_register, out);
+  }
+
+  last = context_of(replayed, 0);
+  uint64_t cycles = 0;
+  unsigned records = 0;
+  Trace::Record record{};
+  for (const uint8_t *in = buffer; in != out; ++records) {
+    in = decode_record(record, last, in, out);
+    if (!in || !replay_record(replayed, cycles, record))
+      return false;
+    if (records == 1 && (record.cycle != 4 || record.wait_key != 5))
+      return false;
+  }
+  return records == 6 && cycles == 8 && replayed.V(1) == 5 &&
+         replayed.V(2) == 5 && replayed.V(3) == live.V(3) &&
+         replayed.get_keys() == live.get_keys() &&
+         replayed.refI(Chip8::Chip8PC) == live.refI(Chip8::Chip8PC);
+}
+static_assert(replays_key_wait());
+} // namespace
@@ -0,0 +1,202 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Chip8.h"
+
+// Execution traces: one record per executed instruction with its cycle, PC
+// and opcode and whatever it changed in the registers and memory.
+//
+// File layout, little endian:
+//   file header: u32 magic "C8TR", u32 version, u32 sizeof(Chip8)
+//   chunks, each: u32 magic "C8TC", u32 stream, u64 cycle, u32 records,
+//                 u32 payload size, Chip8 state before the first record,
+//                 payload
+// Every recorder writes its own stream of chunks. A payload holds records:
+//   u8 flags
+//   varint cycles skipped while waiting for a key   if flags & CycleGap
+//   zigzag varint PC - (previous PC + 2)            if flags & Jump
+//   u8 key whose press ended an Fx0A wait           if flags & KeyWait
+//   u16 key mask before the instruction             if flags & Keys
+//   u16 big endian opcode
+//   u16 mask of changed V registers, new values     if flags & Registers
+//   zigzag varint change of I                       if flags & Index
+//   varint address, u8 count, bytes written         if flags & Memory
+// The state at the start of each chunk lets a reader start decoding, and
+// replaying, at any chunk. A key can be pressed and released again while
+// Fx0A waits, leaving the mask unchanged, so the key that ended a wait is
+// recorded with the next instruction.
+//
+// A Trace owns the file and a thread that writes chunks to it, so the
+// emulation threads never wait for the disk.
+class Trace {
+public:
+  enum Flags : uint8_t {
+    CycleGap = 1,
+    Jump = 2,
+    Keys = 4,
+    Registers = 8,
+    Index = 16,
+    Memory = 32,
+    KeyWait = 64,
+  };
+
+  explicit Trace(const std::string &path);
+  // Writes out everything submitted so far.
+  ~Trace();
+  Trace(const Trace &) = delete;
+  Trace &operator=(const Trace &) = delete;
+
+  bool error_occurred() const;
+  std::string error_message() const;
+
+  // Queues a chunk and returns an empty buffer to fill next. Blocks only
+  // when the disk has fallen far behind.
+  std::vector<uint8_t> submit(std::vector<uint8_t> chunk);
+
+  struct Context;
+  class Recorder;
+  struct Record;
+  class Reader;
+
+private:
+  FILE *file;
+  std::string err;
+  mutable std::mutex mtx;
+  std::condition_variable queued_cv, written_cv;
+  std::deque<std::vector<uint8_t>> queue;
+  std::vector<std::vector<uint8_t>> spare;
+  bool stopping;
+  std::thread thread;
+
+  void write_loop();
+};
+
+// What the next record of a stream is relative to: the previous record, or
+// the state at the start of its chunk.
+struct Trace::Context {
+  uint64_t cycle; // of the previous record
+  uint16_t pc;    // expected
+  uint16_t keys;
+  uint16_t I;
+  uint8_t v[16];
+};
+
+// Records one machine. Each thread driving a machine uses its own recorder,
+// so recording takes no locks until a full chunk is handed to the writer.
+class Trace::Recorder {
+public:
+  Recorder(Trace &, uint32_t stream);
+  ~Recorder();
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Runs one cycle of the machine and records it.
+  Instruction cycle(Chip8 &);
+  void flush();
+
+private:
+  Trace &trace;
+  uint32_t stream;
+  std::vector<uint8_t> buffer;
+  uint8_t *out;   // nullptr while no chunk is open
+  uint8_t *limit; // no record starting past here can overflow the chunk
+  uint32_t records;
+  uint64_t cycles;           // run so far
+  uint64_t last_chunk_cycle; // cycles before the open chunk
+  Context last;
+  int8_t wait_register; // of an Fx0A wait started since the last record
+
+  void begin_chunk(const Chip8 &);
+};
+
+struct Trace::Record {
+  uint64_t cycle; // 1-based number of the cycle that ran the instruction
+  uint16_t pc;
+  uint16_t opcode;
+  int8_t wait_key; // pressed to end an Fx0A wait before, -1 if none
+  uint16_t keys;
+  uint16_t changed_v; // mask
+  uint8_t v[16];      // values after the instruction, where changed
+  bool changed_i;
+  uint16_t I;
+  uint16_t address; // of the memory written
+  uint8_t written;  // bytes written, 0 if none
+  uint8_t memory[16];
+};
+
+// Memory-maps a trace file for reading.
+class Trace::Reader {
+public:
+  explicit Reader(const std::string &path);
+  ~Reader();
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+
+  bool error_occurred() const;
+  std::string error_message() const;
+  std::vector<uint32_t> streams() const;
+
+  // Decodes records of one stream in order, and optionally replays them on
+  // a machine so that the complete state is known before every record.
+  class Cursor {
+  public:
+    // Returns false at the end of the stream.
+    bool next(Record &);
+    // When replaying, the machine right after the last record returned (or
+    // skipped by seek()).
+    const Chip8 &state() const;
+    // Whether replaying ever disagreed with the recorded PC.
+    bool diverged() const;
+
+  private:
+    friend class Reader;
+    // Where decoding continues, with everything records are relative to.
+    struct Position {
+      size_t chunk; // index into chunks
+      const uint8_t *pos, *end;
+      Context last;
+    };
+
+    Cursor(const Reader &, uint32_t stream, bool replay);
+
+    const Reader *reader;
+    std::vector<size_t> chunks; // offsets, in cycle order
+    Position at;
+    bool replay;
+    bool mismatch;
+    uint64_t replay_cycle; // cycles run by machine
+    Chip8 machine;
+
+    const uint8_t *keyframe(size_t chunk) const;
+    bool load(Position &, size_t chunk) const;
+    bool decode(Record &, Position &) const;
+    void commit(const Position &);
+    void reset_machine();
+    void apply(const Record &);
+  };
+
+  // A cursor whose next record is the first one at or after the cycle.
+  Cursor seek(uint32_t stream, uint64_t cycle, bool replay = false) const;
+
+private:
+  struct Chunk {
+    uint32_t stream;
+    uint64_t cycle;
+    size_t offset;
+  };
+
+  const uint8_t *data;
+  size_t size;
+  std::string err;
+  std::vector<Chunk> chunks;
+};
+
+#endif
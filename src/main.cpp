@@ -1,18 +1,268 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
 #include <thread>
 
+#include "Analysis.h"
 #include "Chip8.h"
+#include "Disasm.h"
+#include "Fuzzer.h"
+#include "Lockstep.h"
+#include "Netplay.h"
+#include "Server.h"
+#include "SharedFrame.h"
 #include "SdlInterface.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#ifndef NO_GL
+#include "GridView.h"
+#endif
 
 float scale;
 
+// Frames per second the run-ahead frame length is derived from.
+static const double frame_rate = 60.0;
+// Cycles per run-ahead frame when the cycle rate is not limited.
+static const unsigned default_frame_cycles = 10;
+// Run-ahead frames are emulated on the render thread before every present,
+// and more than a quarter of a second ahead skips over visible motion.
+static const unsigned max_run_ahead_frames = 15;
+// Simulated network delay, more than any rollback window can absorb.
+static const unsigned max_net_delay_ms = 10000;
+// Grid instances that fit in a texture array on any OpenGL 3.3 host, the
+// least GL_MAX_ARRAY_TEXTURE_LAYERS allowed.
+static const unsigned max_grid_instances = 256;
+// Worker threads of the server, fuzzer, grid and analysis; far more than
+// any host has cores, but few enough to be created.
+static const unsigned max_threads = 1024;
+
 void usage(std::string progname) {
   std::cerr << "Usage: " << progname
-            << " [-c cyclespersec] ROMFILE [displaysize]" << std::endl;
+            << " [-c cyclespersec] [-r runaheadframes]"
+            << " [-n localport host:port [--net-delay ms] [--net-loss percent]]"
+            << " [-m metricsfile [--metrics-interval seconds]]"
+            << " [--latency-log file] [--shm name] [-t tracefile]"
+            << " [-s socketpath [--threads count]]"
+            << " [-l cycles [--sample blocks] [--block] [--keys file]]"
+            << " [-f seconds [--corpus dir] [--crashes dir] [--threads count]]"
+            << " [-g instances [--threads count]]"
+            << " [-a outdir [--threads count] ROMFILE|DIR...]"
+            << " [--software] [--filter nearest|scale2x|scale3x] [--phosphor]"
+            << " ROMFILE [displaysize]" << std::endl
+            << "       " << progname << " --shm-dump name" << std::endl
+            << "       " << progname
+            << " --trace-dump tracefile [cycle [count]]" << std::endl;
+}
+
+// The server being run, stopped by SIGINT and SIGTERM so that it removes
+// its socket on the way out.
+static Server *running_server = nullptr;
+
+static void stop_server(int) {
+  if (running_server)
+    running_server->stop();
+}
+
+// Parses a whole decimal number of at most max.
+static bool parse_count(const char *text, unsigned max, unsigned &value) {
+  char *end;
+  unsigned long parsed = std::strtoul(text, &end, 10);
+  if (end == text || *end || text[0] == '-' || parsed > max)
+    return false;
+  value = parsed;
+  return true;
+}
+
+// Prints one frame published by another instance with --shm.
+static int dump_shared_frame(const std::string &name) {
+  SharedFrame::Reader reader(name);
+  SharedFrame::Frame frame;
+  if (reader.error_occurred()) {
+    std::cerr << reader.error_message() << std::endl;
+    return 1;
+  }
+  if (!reader.read(frame)) {
+    std::cerr << "No consistent frame could be read" << std::endl;
+    return 1;
+  }
+  char line[80];
+  snprintf(line, sizeof(line), "frame %llu, cycle %llu, PC %03X, I %03X",
+           (unsigned long long)frame.frame, (unsigned long long)frame.cycles,
+           frame.pc, frame.I);
+  std::cout << line << std::endl;
+  for (int i = 0; i < 16; ++i) {
+    snprintf(line, sizeof(line), "V%X %02X%s", i, frame.v[i],
+             i % 8 == 7 ? "\n" : "  ");
+    std::cout << line;
+  }
+  for (uint64_t row : frame.screen) {
+    for (int x = 0; x < 64; ++x, row <<= 1)
+      std::cout << (row >> 63 ? '#' : '.');
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+// Prints count records of every stream in a file written with --trace,
+// starting at the given cycle.
+static int dump_trace(const std::string &path, uint64_t cycle,
+                      uint64_t count) {
+  Trace::Reader reader(path);
+  if (reader.error_occurred()) {
+    std::cerr << reader.error_message() << std::endl;
+    return 1;
+  }
+  char line[128];
+  for (uint32_t stream : reader.streams()) {
+    std::cout << "stream " << stream << std::endl;
+    Trace::Reader::Cursor cursor = reader.seek(stream, cycle);
+    Trace::Record record;
+    for (uint64_t n = 0; n < count && cursor.next(record); ++n) {
+      int len = snprintf(line, sizeof(line), "%10llu  %03X  %04X  %-24s",
+                         (unsigned long long)record.cycle, record.pc,
+                         record.opcode,
+                         disassemble(Instruction(record.opcode)).c_str());
+      if (record.wait_key >= 0)
+        len += snprintf(line + len, sizeof(line) - len, " key %X",
+                        record.wait_key);
+      for (int i = 0; i < 16; ++i) {
+        if (record.changed_v >> i & 1)
+          len += snprintf(line + len, sizeof(line) - len, " V%X=%02X", i,
+                          record.v[i]);
+      }
+      if (record.changed_i)
+        len += snprintf(line + len, sizeof(line) - len, " I=%03X", record.I);
+      if (record.written)
+        snprintf(line + len, sizeof(line) - len, " [%03X]+%u",
+                 record.address, record.written);
+      std::cout << line << std::endl;
+    }
+  }
+  return 0;
+}
+
+#ifndef NO_GL
+// Runs count copies of the ROM in one grid window until it is closed. Each
+// copy presses random keys so that the screens drift apart. The copies share
+// the memory of initial.
+static int run_grid(const Chip8 &initial, unsigned count,
+                    unsigned frame_cycles, unsigned threads) {
+  GridView view(count);
+  if (view.error_occurred()) {
+    std::cerr << "Could not open the grid: " << view.error_message()
+              << std::endl;
+    return 1;
+  }
+  std::vector<SharedChip8> machines(count, SharedChip8(initial));
+  std::vector<uint32_t> random(count);
+  for (unsigned i = 0; i < count; ++i)
+    random[i] = 0x9E3779B9u * (i + 1);
+  ThreadPool pool(threads);
+  std::atomic<bool> changed;
+  while (view.poll()) {
+    changed = false;
+    pool.parallel_for(count, [&](size_t i) {
+      SharedChip8 &machine = machines[i];
+      uint32_t &state = random[i];
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      // About one key change every 16 frames
+      if (state % 16 == 0)
+        machine.set_keys(machine.get_keys() ^ 1 << (state >> 4) % 16);
+      for (unsigned c = 0; c < frame_cycles; ++c)
+        machine.cycle();
+      if (machine.screen_updated()) {
+        memcpy(view.screen(i), machine.get_display(), sizeof(view.screen(i)));
+        machine.screen_update();
+        changed.store(true, std::memory_order_relaxed);
+      }
+    });
+    view.present(changed);
+  }
+  return 0;
+}
+#endif
+
+// Analyses every ROM (directories are expanded) in parallel, writing a
+// listing, control flow graph and call graph of each into outdir.
+static int run_analysis(const std::vector<std::string> &inputs,
+                        const std::string &outdir, unsigned threads) {
+  std::vector<std::filesystem::path> roms;
+  for (const std::string &input : inputs) {
+    std::error_code ec;
+    if (std::filesystem::is_directory(input, ec)) {
+      for (auto &entry : std::filesystem::directory_iterator(input, ec)) {
+        if (entry.is_regular_file())
+          roms.push_back(entry.path());
+      }
+    } else {
+      roms.push_back(input);
+    }
+  }
+  std::sort(roms.begin(), roms.end());
+  // Outputs are named after the ROM, so two ROMs of the same name would
+  // overwrite each other.
+  std::map<std::filesystem::path, std::filesystem::path> names;
+  for (const std::filesystem::path &rom : roms) {
+    auto [named, added] = names.emplace(rom.filename(), rom);
+    if (!added) {
+      std::cerr << "Both " << named->second.string() << " and "
+                << rom.string() << " would be written as "
+                << rom.filename().string() << std::endl;
+      return 1;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(outdir, ec);
+  if (ec) {
+    std::cerr << "Cannot create " << outdir << ": " << ec.message()
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> summaries(roms.size());
+  ThreadPool pool(threads);
+  pool.parallel_for(roms.size(), [&](size_t i) {
+    std::ifstream file(roms[i], std::ios::binary);
+    std::vector<uint8_t> rom((std::istreambuf_iterator<char>(file)), {});
+    std::string name = roms[i].filename().string();
+    if (!file.is_open() || rom.size() > 0x1000 - 0x200) {
+      summaries[i] = name + ": cannot be loaded";
+      return;
+    }
+    Analysis analysis(rom.data(), rom.size());
+    std::filesystem::path base = std::filesystem::path(outdir) / name;
+    std::ofstream listing(base.string() + ".asm"),
+        cfg(base.string() + ".cfg.dot"), calls(base.string() + ".calls.dot");
+    analysis.write_listing(listing);
+    analysis.write_cfg(cfg);
+    analysis.write_call_graph(calls);
+
+    char line[160];
+    snprintf(line, sizeof(line),
+             "%s: %u instructions, %zu blocks, %zu functions, %u data "
+             "bytes, %u unreached bytes",
+             name.c_str(), analysis.instruction_count(),
+             analysis.blocks().size(), analysis.functions().size(),
+             analysis.byte_count(Analysis::Data),
+             analysis.byte_count(Analysis::Unreached));
+    summaries[i] = line;
+  });
+  for (const std::string &summary : summaries)
+    std::cout << summary << std::endl;
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -22,19 +272,218 @@ int main(int argc, char *argv[]) {
   }
   char *rom_filename = nullptr;
   uint32_t cycle_time = 0;
+  double cycle_rate = 0;
+  unsigned run_ahead_frames = 0;
+  bool use_netplay = false;
+  Netplay::Options net_options;
+  std::string metrics_file;
+  double metrics_interval = 10;
+  std::string latency_log;
+  std::string shm_name;
+  std::string trace_file;
+  Server::Options server_options;
+  uint64_t lockstep_cycles = 0;
+  unsigned lockstep_sample = 1;
+  bool lockstep_blocks = false;
+  std::string keys_file;
+  double fuzz_seconds = 0;
+  unsigned grid_instances = 0;
+  std::string analysis_dir;
+  std::vector<std::string> inputs;
+  Fuzzer::Options fuzz_options;
+  DisplayOptions display;
   for (int i = 1; i < argc; ++i) {
     std::string curr_arg = argv[i];
     if (curr_arg == "-c" || curr_arg == "--cycle") {
       if (i < argc - 1) {
-        cycle_time = ((double)1000.0) / std::atof(argv[++i]);
+        cycle_rate = std::atof(argv[++i]);
+        cycle_time = ((double)1000.0) / cycle_rate;
         std::cerr << "Set cycle time to " << cycle_time << std::endl;
       } else {
         usage(argv[0]);
         return 1;
       }
+    } else if (curr_arg == "-r" || curr_arg == "--run-ahead") {
+      if (i >= argc - 1 ||
+          !parse_count(argv[++i], max_run_ahead_frames, run_ahead_frames)) {
+        std::cerr << "Run-ahead takes 0 to " << max_run_ahead_frames
+                  << " frames" << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "-n" || curr_arg == "--netplay") {
+      std::string remote = i < argc - 2 ? argv[i + 2] : "";
+      size_t colon = remote.rfind(':');
+      if (colon == std::string::npos) {
+        usage(argv[0]);
+        return 1;
+      }
+      unsigned local_port, remote_port;
+      if (!parse_count(argv[i + 1], 65535, local_port) || !local_port ||
+          !parse_count(remote.c_str() + colon + 1, 65535, remote_port) ||
+          !remote_port) {
+        std::cerr << "Ports are 1 to 65535" << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+      net_options.local_port = local_port;
+      net_options.remote_host = remote.substr(0, colon);
+      net_options.remote_port = remote_port;
+      use_netplay = true;
+      i += 2;
+    } else if (curr_arg == "-m" || curr_arg == "--metrics") {
+      if (i < argc - 1) {
+        metrics_file = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--metrics-interval") {
+      if (i < argc - 1) {
+        metrics_interval = std::atof(argv[++i]);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--latency-log") {
+      if (i < argc - 1) {
+        latency_log = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--shm" || curr_arg == "--shm-dump") {
+      if (i >= argc - 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      if (curr_arg == "--shm-dump")
+        return dump_shared_frame(argv[++i]);
+      shm_name = argv[++i];
+    } else if (curr_arg == "-t" || curr_arg == "--trace") {
+      if (i < argc - 1) {
+        trace_file = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--trace-dump") {
+      if (i >= argc - 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      uint64_t from = i + 2 < argc ? std::strtoull(argv[i + 2], nullptr, 10)
+                                   : 0,
+               count = i + 3 < argc ? std::strtoull(argv[i + 3], nullptr, 10)
+                                    : 100;
+      return dump_trace(argv[i + 1], from, count);
+    } else if (curr_arg == "-s" || curr_arg == "--server") {
+      if (i < argc - 1) {
+        server_options.socket_path = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--threads") {
+      if (i >= argc - 1 ||
+          !parse_count(argv[++i], max_threads, server_options.threads)) {
+        std::cerr << "Threads take 0 (one per core) to " << max_threads
+                  << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "-l" || curr_arg == "--lockstep") {
+      if (i < argc - 1) {
+        lockstep_cycles = std::strtoull(argv[++i], nullptr, 10);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--sample") {
+      if (i >= argc - 1 ||
+          !parse_count(argv[++i], UINT_MAX, lockstep_sample)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--block") {
+      lockstep_blocks = true;
+    } else if (curr_arg == "--keys") {
+      if (i < argc - 1) {
+        keys_file = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "-f" || curr_arg == "--fuzz") {
+      if (i < argc - 1) {
+        fuzz_seconds = std::atof(argv[++i]);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--corpus" || curr_arg == "--crashes") {
+      if (i < argc - 1) {
+        if (curr_arg == "--corpus")
+          fuzz_options.corpus_dir = argv[++i];
+        else
+          fuzz_options.crashes_dir = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "-g" || curr_arg == "--grid") {
+      if (i >= argc - 1 ||
+          !parse_count(argv[++i], max_grid_instances, grid_instances) ||
+          !grid_instances) {
+        std::cerr << "The grid takes 1 to " << max_grid_instances
+                  << " instances" << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "-a" || curr_arg == "--analyze") {
+      if (i < argc - 1) {
+        analysis_dir = argv[++i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--software") {
+      display.software = true;
+    } else if (curr_arg == "--filter") {
+      if (i >= argc - 1 ||
+          !SoftRenderer::parse_filter(argv[++i], display.render.filter)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--phosphor") {
+      display.render.phosphor = true;
+    } else if (curr_arg == "--net-delay") {
+      if (i >= argc - 1 ||
+          !parse_count(argv[++i], max_net_delay_ms, net_options.delay_ms)) {
+        std::cerr << "The delay is 0 to " << max_net_delay_ms << " ms"
+                  << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (curr_arg == "--net-loss") {
+      if (i >= argc - 1 ||
+          !parse_count(argv[++i], 100, net_options.loss_percent)) {
+        std::cerr << "The loss is 0 to 100 percent" << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
     } else {
       rom_filename = argv[i];
+      inputs.push_back(rom_filename);
+    }
+  }
+
+  if (!analysis_dir.empty()) {
+    if (inputs.empty()) {
+      usage(argv[0]);
+      return 1;
     }
+    return run_analysis(inputs, analysis_dir, server_options.threads);
   }
 
   if (!rom_filename) {
@@ -64,15 +513,131 @@ int main(int argc, char *argv[]) {
   rom_file.read(reinterpret_cast<char *>(rom), size);
   rom_file.close();
 
+  unsigned frame_cycles = default_frame_cycles;
+  if (cycle_rate > 0)
+    frame_cycles = std::max(1.0, cycle_rate / frame_rate + 0.5);
+
+  if (lockstep_cycles) {
+    std::vector<Lockstep::KeyEvent> events;
+    if (keys_file.empty()) {
+      events = Lockstep::random_events(lockstep_cycles, 1);
+    } else if (!Lockstep::load_events(keys_file, events)) {
+      std::cerr << "Could not open key file " << keys_file << std::endl;
+      return 3;
+    }
+    Lockstep checker(rom, size,
+                     lockstep_blocks ? Lockstep::dispatch_block
+                                     : Lockstep::dispatch_step,
+                     events);
+    delete[] rom;
+    bool identical = checker.run(lockstep_cycles, lockstep_sample);
+    std::cout << checker.report();
+    return identical ? 0 : 2;
+  }
+
+  if (fuzz_seconds > 0) {
+    fuzz_options.seconds = fuzz_seconds;
+    fuzz_options.threads = server_options.threads;
+    Fuzzer fuzzer(fuzz_options, rom, size);
+    delete[] rom;
+    fuzzer.run();
+    return fuzzer.findings() ? 2 : 0;
+  }
+
+  if (grid_instances) {
+#ifdef NO_GL
+    std::cerr << "The grid view needs OpenGL, which this build leaves out"
+              << std::endl;
+    return 1;
+#else
+    Chip8 initial(rom, size);
+    delete[] rom;
+    return run_grid(initial, grid_instances, frame_cycles,
+                    server_options.threads);
+#endif
+  }
+
+  if (!server_options.socket_path.empty()) {
+    server_options.frame_cycles = frame_cycles;
+    server_options.frame_rate = frame_rate;
+    Server server(server_options, rom, size);
+    delete[] rom;
+    if (server.error_occurred()) {
+      std::cerr << "Could not start the server: " << server.error_message()
+                << std::endl;
+      return 1;
+    }
+    std::cout << "Serving " << rom_filename << " on "
+              << server_options.socket_path << std::endl;
+    running_server = &server;
+    struct sigaction action = {};
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    server.run();
+    running_server = nullptr;
+    std::cout << "Stopped serving" << std::endl;
+    return 0;
+  }
+
   Chip8 emulator(rom, size);
+  // Made once from the ROM as loaded, for the debugger's code window.
+  Analysis analysis(rom, size);
 
   delete[] rom;
-  INTERFACE iface(emulator, argc - 2, argv + 2);
+  INTERFACE iface(emulator, argc - 2, argv + 2, display);
   if (iface.error_occurred()) {
     std::cerr << "An error occurred while trying to initialize the interface: "
               << iface.error_message() << std::endl;
     return 1;
   }
+  iface.set_analysis(&analysis);
+  if (!metrics_file.empty())
+    iface.get_metrics().export_to(metrics_file, metrics_interval);
+  if (!latency_log.empty())
+    iface.get_metrics().input_latency().log_to(latency_log);
+  iface.set_frame_cycles(frame_cycles);
+
+  if (run_ahead_frames) {
+    std::cerr << "Running " << run_ahead_frames << " frames ("
+              << frame_cycles << " cycles each) ahead" << std::endl;
+    iface.set_run_ahead(run_ahead_frames, frame_cycles);
+  }
+
+  std::unique_ptr<SharedFrame> shared_frame;
+  if (!shm_name.empty()) {
+    shared_frame.reset(new SharedFrame(shm_name));
+    if (shared_frame->error_occurred()) {
+      std::cerr << shared_frame->error_message() << std::endl;
+      return 1;
+    }
+    iface.set_shared_frame(shared_frame.get(), frame_cycles);
+  }
+
+  // Declared after the Trace, so the recorder is flushed before it closes.
+  std::unique_ptr<Trace> trace;
+  std::unique_ptr<Trace::Recorder> trace_recorder;
+  if (!trace_file.empty()) {
+    trace.reset(new Trace(trace_file));
+    if (trace->error_occurred()) {
+      std::cerr << trace->error_message() << std::endl;
+      return 1;
+    }
+    trace_recorder.reset(new Trace::Recorder(*trace, 0));
+    iface.set_trace(trace_recorder.get());
+  }
+
+  net_options.frame_cycles = frame_cycles;
+  std::unique_ptr<Netplay> netplay;
+  if (use_netplay) {
+    netplay.reset(new Netplay(emulator, net_options));
+    if (netplay->error_occurred()) {
+      std::cerr << "Could not start netplay: " << netplay->error_message()
+                << std::endl;
+      return 1;
+    }
+    iface.set_netplay(netplay.get());
+  }
 
   bool running = true;
   std::chrono::milliseconds cycle_sleep_duration(cycle_time);